@@ -26,9 +26,12 @@
 #define PROTOCOL_VERSION_2 2    // Added bridge to runtime requests
 #define PROTOCOL_VERSION_3 3    // Added field "connected" in target state to allow bridge to reconnect several times
 #define PROTOCOL_VERSION_4 4    // Added field "bridge_to_target" in requests as they are now released by the target
+#define PROTOCOL_VERSION_5 5    // Added ring buffers for host I/O channels, at the end of the debug struct
 
 #define HAL_PRINTF_BUF_SIZE 128
 
+#define HAL_DEBUG_NB_RINGS 4
+
 typedef enum {
   HAL_BRIDGE_REQ_CONNECT = 0,
   HAL_BRIDGE_REQ_DISCONNECT = 1,
@@ -178,6 +181,24 @@ typedef struct {
   volatile int32_t connected;
 } __attribute__((packed)) hal_bridge_state_t;
 
+// Ring buffer of a host I/O channel. Up rings go from the target to the host
+// (e.g. stdout or binary traces) and down rings from the host to the target
+// (e.g. stdin). Each ring has a single producer, which only writes head, and
+// a single consumer, which only writes tail, so that no lock is needed.
+// The producer first writes the data and then moves head, the consumer
+// first reads the data and then moves tail. Both are offsets in the buffer,
+// the ring is empty when they are equal and full when head is just behind
+// tail, so that at most size - 1 bytes are stored.
+// The producer on the target must never wait for the host, it drops what
+// does not fit if the ring is full.
+typedef struct {
+  uint32_t name;           // Address of the channel name, e.g. "stdout", or 0 if unused
+  uint32_t buffer;
+  uint32_t size;
+  volatile uint32_t head;
+  volatile uint32_t tail;
+} __attribute__((packed)) hal_debug_ring_t;
+
 // This structure can be used to interact with the host loader
 typedef struct {
 
@@ -210,6 +231,11 @@ typedef struct {
   uint32_t notif_req_addr;
   uint32_t notif_req_value;
 
+  // Ring buffers, only present from protocol version 5. The bridge drains
+  // the up rings and fills the down rings at each poll.
+  hal_debug_ring_t up_rings[HAL_DEBUG_NB_RINGS];
+  hal_debug_ring_t down_rings[HAL_DEBUG_NB_RINGS];
+
 } __attribute__((packed)) hal_debug_struct_t;
 
 #endif
\ No newline at end of file
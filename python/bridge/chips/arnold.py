@@ -43,26 +43,29 @@ class arnold_debug_bridge(debug_bridge):
         # Reset the chip and tell him we want to load via jtag
         # We keep the reset active until the end so that it sees
         # the boot mode as soon as it boots from rom
+        # The whole sequence is executed by the bridge in one call
         if self.verbose:
             print ("Notifying to boot code that we are doing a JTAG boot")
-        self.get_cable().jtag_reset(True)
-        self.get_cable().jtag_reset(False)
-        self.get_cable().chip_reset(True)
-        self.get_cable().jtag_set_reg(JTAG_SOC_CONFREG, JTAG_SOC_CONFREG_WIDTH, (BOOT_MODE_JTAG << 1) | 1)
-        self.get_cable().chip_reset(False)
+        prog = Micro_prog()
+        prog.jtag_reset(True)
+        prog.jtag_reset(False)
+        prog.chip_reset(True)
+        prog.jtag_set_reg(JTAG_SOC_CONFREG, JTAG_SOC_CONFREG_WIDTH, (BOOT_MODE_JTAG << 1) | 1)
+        prog.chip_reset(False)
 
 
         # Now wait until the boot code tells us we can load the code
         if self.verbose:
             print ("Waiting for notification from boot code")
-        while True:
-            reg_value = self.get_cable().jtag_get_reg(JTAG_SOC_CONFREG, JTAG_SOC_CONFREG_WIDTH, (BOOT_MODE_JTAG << 1) | 1)
-            if reg_value == CONFREG_BOOT_WAIT:
-                break
-        print ("Received for notification from boot code")
+        prog.jtag_poll_reg(JTAG_SOC_CONFREG, JTAG_SOC_CONFREG_WIDTH, (BOOT_MODE_JTAG << 1) | 1, 0xffffffff, CONFREG_BOOT_WAIT)
 
         # Stall the FC
-        self.write(0x1A110000, 4, [0, 0, 1, 0])
+        prog.write_32(0x1A110000, 0x00010000)
+
+        if self.exec_prog(prog) is None:
+            return -1
+
+        print ("Received for notification from boot code")
 
         print ("Stopped core")
 
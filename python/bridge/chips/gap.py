@@ -30,6 +30,9 @@ CONFREG_BOOT_WAIT = 1
 CONFREG_PGM_LOADED = 1
 CONFREG_INIT = 0
 
+# Maximum time the flasher can take to program one buffer
+FLASHER_TIMEOUT_US = 60000000
+
 class gap_debug_bridge(debug_bridge):
 
     def __init__(self, config, binaries=[], verbose=False, fimages=[]):
@@ -46,9 +49,10 @@ class gap_debug_bridge(debug_bridge):
         # the boot mode as soon as it boots from rom
         if self.verbose:
             print ("Notifying to boot code that we are doing a JTAG boot")
-        self.get_cable().chip_reset(True)
-        self.get_cable().jtag_set_reg(JTAG_SOC_CONFREG, JTAG_SOC_CONFREG_WIDTH, BOOT_MODE_JTAG)
-        self.get_cable().chip_reset(False)
+        prog = Micro_prog()
+        prog.chip_reset(True)
+        prog.jtag_set_reg(JTAG_SOC_CONFREG, JTAG_SOC_CONFREG_WIDTH, BOOT_MODE_JTAG)
+        prog.chip_reset(False)
 
         # Removed synchronization with boot code due to HW bug, it is better
         # to stop fc as soon as possible
@@ -63,7 +67,10 @@ class gap_debug_bridge(debug_bridge):
 #        print ("Received for notification from boot code")
 
         # Stall the FC
-        self.write(0x1B300000, 4, [0, 0, 1, 0])
+        prog.write_32(0x1B300000, 0x00010000)
+
+        if self.exec_prog(prog) is None:
+            return -1
 
         # Configure FLL with no lock to avoid the HW bug with fll
         #self.write_32(0x1a100004, 0x840005f5)
@@ -126,6 +133,13 @@ class gap_debug_bridge(debug_bridge):
         return 0
 
 
+    def wait_flasher_ready(self, addr):
+        # The flasher sets the word to a non-zero value when it is ready
+        done, value = self.poll_until(addr, 0xffffffff, 0, timeout_us=FLASHER_TIMEOUT_US, negate=True)
+        if not done:
+            raise Exception('Timeout while waiting for the flasher (addr: 0x%x)' % addr)
+
+
     def flash(self, fimages):
         MAX_BUFF_SIZE = (350*1024)
         f_path = fimages[0]
@@ -144,10 +158,7 @@ class gap_debug_bridge(debug_bridge):
         else:
             n_iter = f_size // MAX_BUFF_SIZE
 
-        flasher_ready = self.read_32(addrFlasherRdy)
-        while(flasher_ready == 0):
-            flasher_ready = self.read_32(addrFlasherRdy)
-        flasher_ready = 0;
+        self.wait_flasher_ready(addrFlasherRdy)
         addrBuffer = self.read_32((addrHeader+20))
         indexAddr = 0
         self.write_32(addrFlashAddr, 0)
@@ -164,9 +175,7 @@ class gap_debug_bridge(debug_bridge):
             self.write_32(addrImgRdy, 1)
             self.write_32(addrFlasherRdy, 0)
             if (i!=(n_iter-1)):
-                flasher_ready = self.read_32(addrFlasherRdy)
-                while(flasher_ready == 0):
-                    flasher_ready = self.read_32(addrFlasherRdy)
+                self.wait_flasher_ready(addrFlasherRdy)
         f_img.close()
         return 0
 
@@ -30,6 +30,9 @@ CONFREG_BOOT_WAIT = 1
 CONFREG_PGM_LOADED = 1
 CONFREG_INIT = 0
 
+# Maximum time the flasher can take to program one buffer
+FLASHER_TIMEOUT_US = 60000000
+
 class gap_debug_bridge(debug_bridge):
 
     def __init__(self, config, binaries=[], verbose=False, fimages=[]):
@@ -41,25 +44,33 @@ class gap_debug_bridge(debug_bridge):
         self.stopped = False
 
     def reset(self, jtag_boot=True):
-        self.get_cable().jtag_reset(True)
-        self.get_cable().jtag_reset(False)
-        self.get_cable().chip_reset(True)
+        prog = Micro_prog()
+        prog.jtag_reset(True)
+        prog.jtag_reset(False)
+        prog.chip_reset(True)
         if jtag_boot:
-            self.get_cable().jtag_set_reg(JTAG_SOC_CONFREG, JTAG_SOC_CONFREG_WIDTH, (BOOT_MODE_JTAG << 1) | 1)
-        self.get_cable().chip_reset(False)
+            prog.jtag_set_reg(JTAG_SOC_CONFREG, JTAG_SOC_CONFREG_WIDTH, (BOOT_MODE_JTAG << 1) | 1)
+        prog.chip_reset(False)
+        if self.exec_prog(prog) is None:
+            return -1
         return 0
 
-    def set_boot_mode(self, boot_mode, reset=True):
+    def _set_boot_mode_prog(self, prog, boot_mode, reset=True):
         if self.verbose:
             print ("Notifying to boot code new boot mode (mode: %d)" % boot_mode)
         if reset:
-            self.get_cable().chip_reset(True)
-        self.get_cable().jtag_set_reg(JTAG_SOC_CONFREG, JTAG_SOC_CONFREG_WIDTH, (boot_mode << 1) | 1)
+            prog.chip_reset(True)
+        prog.jtag_set_reg(JTAG_SOC_CONFREG, JTAG_SOC_CONFREG_WIDTH, (boot_mode << 1) | 1)
 
         if reset:
-            self.get_cable().chip_reset(False)
+            prog.chip_reset(False)
         self.boot_mode = boot_mode
 
+    def set_boot_mode(self, boot_mode, reset=True):
+        prog = Micro_prog()
+        self._set_boot_mode_prog(prog, boot_mode, reset)
+        self.exec_prog(prog)
+
     def wait_available(self):
         if self.verbose:
             print ("Waiting for target to be available")
@@ -82,6 +93,11 @@ class gap_debug_bridge(debug_bridge):
             print ("Target is available")
 
 
+    def _wait_ready_prog(self, prog, boot_mode):
+        if self.verbose:
+            print ("Waiting for notification from boot code")
+        prog.jtag_poll_reg(JTAG_SOC_CONFREG, JTAG_SOC_CONFREG_WIDTH, (boot_mode << 1) | 1, 0xffffffff, CONFREG_BOOT_WAIT)
+
     def wait_ready(self, boot_mode=None):
         if boot_mode is None:
             boot_mode = self.boot_mode
@@ -90,29 +106,33 @@ class gap_debug_bridge(debug_bridge):
             print ('Can not wait for boot code if the boot mode is unknown')
             return -1
 
-        if self.verbose:
-            print ("Waiting for notification from boot code")
-        while True:
-            reg_value = self.get_cable().jtag_get_reg(JTAG_SOC_CONFREG, JTAG_SOC_CONFREG_WIDTH, (boot_mode << 1) | 1)
-
-            if reg_value == CONFREG_BOOT_WAIT:
-                break
+        prog = Micro_prog()
+        self._wait_ready_prog(prog, boot_mode)
+        if self.exec_prog(prog) is None:
+            return -1
         print ("Received for notification from boot code")
 
         return 0
 
     def stop(self):
+        # The whole sequence is executed by the bridge in one call
+        prog = Micro_prog()
+
         # Reset the chip and tell him we want to load via jtag
         # We keep the reset active until the end so that it sees
         # the boot mode as soon as it boots from rom
-        self.set_boot_mode(BOOT_MODE_JTAG)
+        self._set_boot_mode_prog(prog, BOOT_MODE_JTAG)
 
         # Now wait until the boot code tells us we can load the code
-        if self.wait_ready() != 0:
-            return -1
+        self._wait_ready_prog(prog, BOOT_MODE_JTAG)
 
         # Stall the FC
-        self.write(0x1B300000, 4, [0, 0, 1, 0])
+        prog.write_32(0x1B300000, 0x00010000)
+
+        if self.exec_prog(prog) is None:
+            return -1
+
+        print ("Received for notification from boot code")
 
         self.stopped = True
 
@@ -192,6 +212,13 @@ class gap_debug_bridge(debug_bridge):
         return 0
 
 
+    def wait_flasher_ready(self, addr):
+        # The flasher sets the word to a non-zero value when it is ready
+        done, value = self.poll_until(addr, 0xffffffff, 0, timeout_us=FLASHER_TIMEOUT_US, negate=True)
+        if not done:
+            raise Exception('Timeout while waiting for the flasher (addr: 0x%x)' % addr)
+
+
     def flash(self, fimages):
         MAX_BUFF_SIZE = (350*1024)
         f_path = fimages[0]
@@ -210,10 +237,7 @@ class gap_debug_bridge(debug_bridge):
         else:
             n_iter = f_size // MAX_BUFF_SIZE
 
-        flasher_ready = self.read_32(addrFlasherRdy)
-        while(flasher_ready == 0):
-            flasher_ready = self.read_32(addrFlasherRdy)
-        flasher_ready = 0;
+        self.wait_flasher_ready(addrFlasherRdy)
         addrBuffer = self.read_32((addrHeader+20))
         indexAddr = 0
         self.write_32(addrFlashAddr, 0)
@@ -230,8 +254,6 @@ class gap_debug_bridge(debug_bridge):
             self.write_32(addrImgRdy, 1)
             self.write_32(addrFlasherRdy, 0)
             if (i!=(n_iter-1)):
-                flasher_ready = self.read_32(addrFlasherRdy)
-                while(flasher_ready == 0):
-                    flasher_ready = self.read_32(addrFlasherRdy)
+                self.wait_flasher_ready(addrFlasherRdy)
         f_img.close()
         return 0
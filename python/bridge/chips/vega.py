@@ -42,13 +42,12 @@ class vega_debug_bridge(debug_bridge):
 
     def reset(self, stop=True):
 
-        
-
+        prog = Micro_prog()
 
         if self.first_reset:
             # The first time, we need to wait enough time to let the voltage
             # regulator converge
-            self.get_cable().chip_reset(True, 5000000)
+            prog.chip_reset(True, 5000000)
             self.first_reset = False
 
         # Reset the chip and tell him we want to load via jtag
@@ -57,30 +56,34 @@ class vega_debug_bridge(debug_bridge):
 
         # Use bootsel pad to tell boot code to stop
         if stop:
-            self.get_cable().chip_config(1)
+            prog.chip_config(1)
 
         # Due to voltage convergence and so on we need to wait
         # 200ms when the reset is low
-        #self.get_cable().chip_reset(True, 200000000)
-        self.get_cable().chip_reset(True, 100000000)
+        #prog.chip_reset(True, 200000000)
+        prog.chip_reset(True, 100000000)
         # It also takes some time before the JTAG is ready
-        self.get_cable().chip_reset(False, 4000000)
+        prog.chip_reset(False, 4000000)
 
-        #self.get_cable().jtag_reset(True)
-        self.get_cable().jtag_reset(False)
+        #prog.jtag_reset(True)
+        prog.jtag_reset(False)
+
+        if self.exec_prog(prog) is None:
+            return -1
 
         return 0
 
 
     def wait_eoc(self):
 
-        while True:
-            value = self.read_32(0x1a1040a0)
+        # No timeout as the application can run for any amount of time
+        done, value = self.poll_until(0x1a1040a0, 1 << 31, 1 << 31, min_us=1000, max_us=100000)
 
-            if (value >> 31) == 1:
-                return value & 0x7fffffff
+        # Without timeout, this only fails if the target could not be accessed
+        if not done:
+            raise Exception('Failed to read end of computation status')
 
-            time.sleep(0.1)
+        return value & 0x7fffffff
 
 
     def jtag_hyper_boot(self):
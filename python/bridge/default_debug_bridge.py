@@ -22,6 +22,8 @@ import os.path
 import json_tools as js
 from elftools.elf.elffile import ELFFile
 import time
+import bisect
+from bridge.micro_prog import *
 
 
 class Ctype_cable(object):
@@ -41,6 +43,21 @@ class Ctype_cable(object):
         self.module.cable_read.argtypes = \
             [ctypes.c_void_p, ctypes.c_int, ctypes.c_int, ctypes.c_char_p]
 
+        self.module.cable_fill.argtypes = \
+            [ctypes.c_void_p, ctypes.c_int, ctypes.c_int, ctypes.c_char_p, ctypes.c_int]
+        self.module.cable_fill.restype = ctypes.c_bool
+
+        self.module.cable_barrier.argtypes = [ctypes.c_void_p]
+        self.module.cable_barrier.restype = ctypes.c_bool
+
+        self.module.cable_poll_until.argtypes = \
+            [ctypes.c_void_p, ctypes.c_uint, ctypes.c_uint32, ctypes.c_uint32, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_bool, ctypes.POINTER(ctypes.c_uint32)]
+        self.module.cable_poll_until.restype = ctypes.c_bool
+
+        self.module.cable_exec_prog.argtypes = \
+            [ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint32), ctypes.c_int, ctypes.POINTER(ctypes.c_uint32), ctypes.c_int]
+        self.module.cable_exec_prog.restype = ctypes.c_bool
+
         self.module.cable_reg_write.argtypes = \
             [ctypes.c_void_p, ctypes.c_int, ctypes.c_char_p, ctypes.c_int]
 
@@ -100,6 +117,23 @@ class Ctype_cable(object):
         data = (ctypes.c_char * size).from_buffer(bytearray(buffer))
         self.module.cable_write(self.instance, addr, size, data)
 
+    def fill(self, addr, size, pattern):
+        return self.module.cable_fill(self.instance, addr, size, bytes(pattern), len(pattern))
+
+    def barrier(self):
+        return self.module.cable_barrier(self.instance)
+
+    def poll_until(self, addr, mask, value, timeout_us=0, min_us=100, max_us=10000, negate=False):
+        last = ctypes.c_uint32(0)
+        result = self.module.cable_poll_until(self.instance, addr, mask, value, timeout_us, min_us, max_us, negate, ctypes.byref(last))
+        return result, last.value
+
+    def exec_prog(self, code, nb_captures):
+        captures = (ctypes.c_uint32 * max(nb_captures, 1))()
+        if not self.module.cable_exec_prog(self.instance, code, len(code), captures, nb_captures):
+            return None
+        return list(captures)[0:nb_captures]
+
     def reg_write(self, addr, size, buffer, device=-1):
         data = (ctypes.c_char * size).from_buffer(bytearray(buffer))
         self.module.cable_reg_write(self.instance, addr, data, device)
@@ -163,6 +197,7 @@ class debug_bridge(object):
             self.cable_name = 'ftdi'
         self.binaries = binaries
         self.reqloop_handle = None
+        self.watch_handle = None
         self.verbose = verbose
         self.gdb_handle = None
         self.cable_config = config.get('**/debug_bridge/cable')
@@ -201,6 +236,27 @@ class debug_bridge(object):
         
         self.module.bridge_reqloop_close.argtypes = [ctypes.c_void_p, ctypes.c_int]
 
+        self.module.profiler_open.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int]
+        self.module.profiler_open.restype = ctypes.c_void_p
+
+        self.module.profiler_read.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint32), ctypes.c_int]
+        self.module.profiler_read.restype = ctypes.c_int
+
+        self.module.profiler_close.argtypes = [ctypes.c_void_p]
+        self.module.profiler_close.restype = ctypes.c_int
+
+        self.module.mem_watch_open.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_int, ctypes.c_int]
+        self.module.mem_watch_open.restype = ctypes.c_void_p
+
+        self.module.mem_watch_add.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_uint, ctypes.c_int, ctypes.c_int]
+        self.module.mem_watch_add.restype = ctypes.c_bool
+
+        self.module.mem_watch_start.argtypes = [ctypes.c_void_p]
+        self.module.mem_watch_start.restype = ctypes.c_bool
+
+        self.module.mem_watch_close.argtypes = [ctypes.c_void_p]
+        self.module.mem_watch_close.restype = ctypes.c_int
+
         self.module.bridge_init(config.dump_to_string().encode('utf-8'), verbose)
 
         #self.module.jtag_shift.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.POINTER(ctypes.c_char_p), ctypes.POINTER(ctypes.c_char_p)]
@@ -259,11 +315,7 @@ class debug_bridge(object):
                         addr = segment['p_paddr'] + segment['p_filesz']
                         size = segment['p_memsz'] - segment['p_filesz']
                         print ('Init section to 0 (base: 0x%x, size: 0x%x)' % (addr, size))
-                        self.write(
-                            addr,
-                            size,
-                            [0] * size
-                        )
+                        self.fill(addr, size, b'\x00')
 
 
             set_pc_addr_config = self.config.get('**/debug_bridge/set_pc_addr')
@@ -325,6 +377,23 @@ class debug_bridge(object):
     def write(self, addr, size, buffer):
         return self.get_cable().write(addr, size, buffer)
 
+    def fill(self, addr, size, pattern=b'\x00'):
+        return self.get_cable().fill(addr, size, pattern)
+
+    def barrier(self):
+        return self.get_cable().barrier()
+
+    def poll_until(self, addr, mask, value, timeout_us=0, min_us=100, max_us=10000, negate=False):
+        """Polls the 32-bit word at addr inside the bridge until (word & mask)
+        is value (or is not, if negate is True). Returns a tuple with False
+        if the timeout was reached, and the last word read."""
+        return self.get_cable().poll_until(addr, mask, value, timeout_us, min_us, max_us, negate)
+
+    def exec_prog(self, prog):
+        """Executes a Micro_prog in one call, returns the list of captured
+        values, or None if an operation failed."""
+        return self.get_cable().exec_prog(prog.compile(), prog.nb_captures)
+
     def write_int(self, addr, value, size):
         return self.write(addr, size, value.to_bytes(size, byteorder='little'))
 
@@ -383,11 +452,156 @@ class debug_bridge(object):
                                 return t_vaddr
         return 0
 
+    def _get_binary_symbol(self, name, binaries=[]):
+
+        binaries = binaries + self.binaries
+
+        for binary in binaries:
+            with open(binary, 'rb') as file:
+                elf = ELFFile(file)
+                for section in elf.iter_sections():
+                    if section.header['sh_type'] == 'SHT_SYMTAB':
+                        for symbol in section.iter_symbols():
+                            if symbol.name == name:
+                                return (symbol.entry['st_value'], symbol.entry['st_size'])
+        return None
+
+    def watch(self, entries, output, binary=False, period_us=1000, binaries=[]):
+
+        # Entries are <symbol or address>[:<element size>[:<count>]]. For
+        # symbols, the count is by default deduced from the symbol size.
+        parsed = []
+        for entry in entries:
+            fields = entry.split(':')
+            size = int(fields[1], 0) if len(fields) > 1 else 4
+            count = int(fields[2], 0) if len(fields) > 2 else None
+
+            if size not in [1, 2, 4, 8]:
+                raise Exception('Invalid element size in watch entry, must be 1, 2, 4 or 8: ' + entry)
+            if count is not None and count <= 0:
+                raise Exception('Invalid count in watch entry: ' + entry)
+
+            try:
+                addr = int(fields[0], 0)
+                if count is None:
+                    count = 1
+            except ValueError:
+                symbol = self._get_binary_symbol(fields[0], binaries)
+                if symbol is None:
+                    raise Exception('Unknown symbol: ' + fields[0])
+                addr = symbol[0]
+                if count is None:
+                    count = max(int(symbol[1] / size), 1)
+
+            parsed.append((fields[0], addr, size, count))
+
+        self.watch_handle = self.module.mem_watch_open(self.get_cable().get_instance(), output.encode('utf-8'), binary, period_us)
+
+        for name, addr, size, count in parsed:
+            if self.verbose:
+                print ('Watching %s (addr: 0x%x, size: %d, count: %d)' % (name, addr, size, count))
+
+            if not self.module.mem_watch_add(self.watch_handle, name.encode('utf-8'), addr, size, count):
+                self.watch_close()
+                raise Exception('Invalid memory watch entry: ' + name)
+
+        if not self.module.mem_watch_start(self.watch_handle):
+            self.watch_close()
+            raise Exception('Failed to start memory watch: ' + self.module.bridge_get_error().decode('utf-8'))
+
+        return 0
+
+    def watch_close(self):
+        if self.watch_handle is not None:
+            nb_samples = self.module.mem_watch_close(self.watch_handle)
+            self.watch_handle = None
+            if self.verbose:
+                print ('Memory watch stopped (samples: %d)' % nb_samples)
+        return 0
+
+    def _get_binary_functions(self, binaries=[]):
+
+        binaries = binaries + self.binaries
+
+        functions = []
+        for binary in binaries:
+            with open(binary, 'rb') as file:
+                elf = ELFFile(file)
+                for section in elf.iter_sections():
+                    if section.header['sh_type'] == 'SHT_SYMTAB':
+                        for symbol in section.iter_symbols():
+                            if symbol.entry['st_info']['type'] == 'STT_FUNC':
+                                functions.append((symbol.entry['st_value'], symbol.entry['st_size'], symbol.name))
+
+        functions.sort()
+        return functions
+
+    def profile(self, duration=1.0, period_us=1000, output=None, binaries=[]):
+
+        # Samples are accumulated per core and PC while the target is
+        # running, and only symbolized at the end
+        handle = self.module.profiler_open(self.get_cable().get_instance(), period_us, 65536)
+
+        buffer_size = 4096
+        buffer = (ctypes.c_uint32 * (buffer_size * 2))()
+        counts = {}
+        end = time.time() + duration
+
+        while True:
+            done = time.time() >= end
+            nb_samples = self.module.profiler_read(handle, buffer, buffer_size)
+            for i in range(0, nb_samples):
+                key = (buffer[i*2], buffer[i*2+1])
+                counts[key] = counts.get(key, 0) + 1
+            if done:
+                break
+            if nb_samples < buffer_size:
+                time.sleep(0.01)
+
+        dropped = self.module.profiler_close(handle)
+
+        functions = self._get_binary_functions(binaries)
+        addresses = [function[0] for function in functions]
+
+        def symbolize(pc):
+            index = bisect.bisect_right(addresses, pc) - 1
+            if index >= 0:
+                addr, size, name = functions[index]
+                if pc < addr + max(size, 1):
+                    return name
+            return '0x%x' % pc
+
+        flat = {}
+        stacks = {}
+        total = 0
+        for (core, pc), count in counts.items():
+            function = symbolize(pc)
+            flat[function] = flat.get(function, 0) + count
+            stack = 'cluster_%d_core_%d;%s' % (core >> 16, core & 0xffff, function)
+            stacks[stack] = stacks.get(stack, 0) + count
+            total += count
+
+        print ('Flat profile (samples: %d, dropped: %d)' % (total, dropped))
+        print ('  %8s %7s  %s' % ('samples', '%', 'function'))
+        for function, count in sorted(flat.items(), key=lambda x: x[1], reverse=True):
+            print ('  %8d %6.2f%%  %s' % (count, count * 100.0 / total, function))
+
+        # Collapsed stacks, as used by flame graph tools. Frames are not
+        # unwound, thus there is only the core and the sampled function.
+        if output is not None:
+            with open(output, 'w') as file:
+                for stack, count in sorted(stacks.items()):
+                    file.write('%s %d\n' % (stack, count))
+
+        return 0
+
     def reset(self):
-        self.get_cable().jtag_reset(True)
-        self.get_cable().jtag_reset(False)
-        self.get_cable().chip_reset(True)
-        self.get_cable().chip_reset(False)
+        prog = Micro_prog()
+        prog.jtag_reset(True)
+        prog.jtag_reset(False)
+        prog.chip_reset(True)
+        prog.chip_reset(False)
+        self.exec_prog(prog)
         return 0
 
     def ioloop(self):
@@ -565,7 +779,11 @@ class debug_bridge(object):
         # The wait function returns in case reqloop has been launched
         # as it will check for end of application.
         if self.reqloop_handle is not None:
-            return self.module.bridge_reqloop_close(self.reqloop_handle, 0)
+            status = self.module.bridge_reqloop_close(self.reqloop_handle, 0)
+            self.watch_close()
+            return status
+
+        self.watch_close()
 
         return 0
 
@@ -0,0 +1,110 @@
+#
+# Copyright (C) 2018 ETH Zurich and University of Bologna
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+# Authors: Germain Haugou, ETH (germain.haugou@iis.ee.ethz.ch)
+
+import ctypes
+
+# Opcodes, must be kept in sync with src/micro_prog.hpp
+MP_END         = 0x00
+MP_WRITE       = 0x01
+MP_READ        = 0x02
+MP_RMW         = 0x03
+MP_POLL        = 0x04
+MP_DELAY       = 0x05
+MP_JTAG_SET    = 0x06
+MP_JTAG_GET    = 0x07
+MP_JTAG_POLL   = 0x08
+MP_CHIP_RESET  = 0x09
+MP_CHIP_CONFIG = 0x0a
+MP_JTAG_RESET  = 0x0b
+
+
+class Micro_prog(object):
+    """Sequence of cable operations executed by the bridge in a single call.
+
+    The operations are recorded with the methods below, which mirror the
+    cable ones, and compiled once into the bytecode of src/micro_prog.hpp.
+    The read methods return a capture slot, which indexes the list returned
+    by debug_bridge.exec_prog.
+    """
+
+    def __init__(self):
+        self.code = []
+        self.nb_captures = 0
+        self.compiled = None
+
+    def __emit(self, opcode, *args):
+        self.code.append(opcode)
+        for arg in args:
+            self.code.append(arg & 0xffffffff)
+        self.compiled = None
+        return self
+
+    def __capture(self):
+        slot = self.nb_captures
+        self.nb_captures += 1
+        return slot
+
+    def write(self, addr, value, size=4):
+        assert size in [1, 2, 4], 'Micro-program accesses can only be 1, 2 or 4 bytes'
+        return self.__emit(MP_WRITE, addr, size, value)
+
+    def write_32(self, addr, value):
+        return self.write(addr, value, 4)
+
+    def read(self, addr, size=4):
+        assert size in [1, 2, 4], 'Micro-program accesses can only be 1, 2 or 4 bytes'
+        slot = self.__capture()
+        self.__emit(MP_READ, addr, size, slot)
+        return slot
+
+    def read_32(self, addr):
+        return self.read(addr, 4)
+
+    def rmw_32(self, addr, mask, value):
+        return self.__emit(MP_RMW, addr, mask, value)
+
+    def poll_32(self, addr, mask, value, timeout_us=0, negate=False):
+        return self.__emit(MP_POLL, addr, mask, value, timeout_us, 1 if negate else 0)
+
+    def delay(self, duration_us):
+        return self.__emit(MP_DELAY, duration_us)
+
+    def jtag_set_reg(self, reg, width, value, ir_len=-1):
+        return self.__emit(MP_JTAG_SET, reg, width, value, ir_len)
+
+    def jtag_get_reg(self, reg, width, value, ir_len=-1):
+        slot = self.__capture()
+        self.__emit(MP_JTAG_GET, reg, width, value, ir_len, slot)
+        return slot
+
+    def jtag_poll_reg(self, reg, width, value, mask, expected, ir_len=-1, timeout_us=0):
+        return self.__emit(MP_JTAG_POLL, reg, width, value, ir_len, mask, expected, timeout_us)
+
+    def chip_reset(self, active, duration=1000000):
+        return self.__emit(MP_CHIP_RESET, 1 if active else 0, duration)
+
+    def chip_config(self, value):
+        return self.__emit(MP_CHIP_CONFIG, value)
+
+    def jtag_reset(self, active):
+        return self.__emit(MP_JTAG_RESET, 1 if active else 0)
+
+    def compile(self):
+        if self.compiled is None:
+            self.compiled = (ctypes.c_uint32 * (len(self.code) + 1))(*(self.code + [MP_END]))
+        return self.compiled
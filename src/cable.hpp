@@ -21,6 +21,12 @@
 #ifndef __CABLES_CABLE_HPP__
 #define __CABLES_CABLE_HPP__
 
+#include <chrono>
+#include <future>
+#include <functional>
+#include <thread>
+#include <vector>
+
 #include "json.hpp"
 #include "cables/log.h"
 
@@ -51,11 +57,151 @@ public:
 
 
 
+// Bounded exponential backoff shared by all the loops polling the target.
+// The delay between two tries starts at min_us and doubles up to max_us, and
+// wait returns false once timeout_us has elapsed (0 means no timeout). With
+// min_us at 0, the first retry is immediate and the next ones start at 1us,
+// unless max_us is also 0.
+class Poll_backoff
+{
+public:
+  Poll_backoff(int timeout_us=0, int min_us=0, int max_us=0)
+  : timeout_us(timeout_us), min_us(min_us), max_us(max_us < min_us ? min_us : max_us)
+  {
+    this->reset();
+  }
+
+  // Restarts from the minimum delay, e.g. after some activity
+  void reset()
+  {
+    this->start = std::chrono::steady_clock::now();
+    this->period_us = this->min_us;
+  }
+
+  int get_period() { return this->period_us; }
+
+  // Returns the delay before the next try and doubles it, for callers
+  // which wait by themselves
+  int next_period()
+  {
+    int period = this->period_us;
+    this->period_us = this->period_us ? this->period_us * 2 : 1;
+    if (this->period_us > this->max_us)
+      this->period_us = this->max_us;
+    return period;
+  }
+
+  // Waits before the next try, returns false if the timeout is reached
+  bool wait()
+  {
+    auto now = std::chrono::steady_clock::now();
+    if (this->timeout_us && now - this->start > std::chrono::microseconds(this->timeout_us))
+      return false;
+
+    int period = this->next_period();
+    if (period)
+      std::this_thread::sleep_for(std::chrono::microseconds(period));
+
+    return true;
+  }
+
+private:
+  std::chrono::steady_clock::time_point start;
+  int timeout_us;
+  int min_us;
+  int max_us;
+  int period_us;
+};
+
+
+
+// One element of a list of accesses
+class Cable_io_elem
+{
+public:
+  Cable_io_elem(bool write, unsigned int addr, int size, char *buffer) : write(write), addr(addr), size(size), buffer(buffer) {}
+  bool write;
+  unsigned int addr;
+  int size;
+  char *buffer;
+};
+
+
+
 class Cable_io_itf
 {
 public:
   virtual bool access(bool write, unsigned int addr, int size, char* buffer, int device=-1) { return false; }
   virtual bool reg_access(bool write, unsigned int addr, char* buffer, int device=-1) { return false; }
+
+  // Executes a list of accesses in order, with the cable taken only once (one
+  // lock and one IO thread request). Each access is still its own cable
+  // transaction, except for consecutive ones in the same direction to
+  // contiguous addresses, which a cable may merge into one burst. Returns
+  // false if any of them failed.
+  virtual bool access_list(std::vector<Cable_io_elem> &list, int device=-1)
+  {
+    bool result = true;
+    for (auto &elem: list)
+    {
+      result = this->access(elem.write, elem.addr, elem.size, elem.buffer, device) && result;
+    }
+    return result;
+  }
+
+  // Reads the 32-bit word at addr until (word & mask) == value, or until it
+  // is different if negate is true, with a backoff between min_us and max_us.
+  // Returns false on timeout or access error, the last word read is returned
+  // in last if not NULL.
+  virtual bool poll_until(unsigned int addr, uint32_t mask, uint32_t value, int timeout_us, int min_us=0, int max_us=0, bool negate=false, uint32_t *last=NULL, int device=-1)
+  {
+    Poll_backoff backoff(timeout_us, min_us, max_us);
+    while (1)
+    {
+      uint32_t data;
+      if (!this->access(false, addr, 4, (char *)&data, device))
+        return false;
+      if (last)
+        *last = data;
+      if (((data & mask) == value) != negate)
+        return true;
+      if (!backoff.wait())
+        return false;
+    }
+  }
+
+  // Fills size bytes at addr with a repeating pattern of pattern_len bytes
+  virtual bool fill(unsigned int addr, int size, const char* pattern, int pattern_len, int device=-1) { return false; }
+
+  // Size of the biggest access the cable does in one burst, bigger transfers
+  // should be split in multiples of it
+  virtual int get_burst_size() { return 4096; }
+
+  // Makes sure all previous writes have reached the target, for cables which
+  // can delay them.
+  virtual bool barrier() { return true; }
+
+  // Asynchronous variants of the accesses above. The buffer must stay valid
+  // until the returned future is set or the callback is called.
+  // By default they are executed synchronously and the future is already set
+  // when returning, cables which can queue accesses overload them.
+  virtual std::future<bool> access_async(bool write, unsigned int addr, int size, char* buffer, int device=-1, std::function<void(bool)> callback=nullptr)
+  {
+    std::promise<bool> promise;
+    bool result = this->access(write, addr, size, buffer, device);
+    if (callback) callback(result);
+    promise.set_value(result);
+    return promise.get_future();
+  }
+
+  virtual std::future<bool> reg_access_async(bool write, unsigned int addr, char* buffer, int device=-1, std::function<void(bool)> callback=nullptr)
+  {
+    std::promise<bool> promise;
+    bool result = this->reg_access(write, addr, buffer, device);
+    if (callback) callback(result);
+    promise.set_value(result);
+    return promise.get_future();
+  }
 };
 
 
@@ -65,6 +211,9 @@ class Cable_ctrl_itf
 public:
   virtual bool chip_reset(bool active, int duration) { return false; }
   virtual bool chip_config(uint32_t config) { return false; }
+  // Incremented each time the chip is reset, so that host-side copies of the
+  // target state can find out they are stale
+  virtual unsigned int get_reset_count() { return 0; }
 };
 
 
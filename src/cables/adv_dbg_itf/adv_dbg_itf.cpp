@@ -20,7 +20,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
 #include <unistd.h>
 
 #include "adv_dbg_itf.hpp"
@@ -30,6 +29,13 @@
 
 #define JTAG_SOC_AXIREG  4
 
+// Maximum size of the bursts used to fill memory, this is also the size of
+// the host buffer holding the pattern
+#define FILL_BURST_SIZE 1024
+
+// Maximum size of the bursts used to read memory
+#define READ_BURST_SIZE 2048
+
 
 Adv_dbg_itf::Adv_dbg_itf(js::config *system_config, js::config *config, Log* log, Cable *m_dev) : Cable(system_config), log(log), m_dev(m_dev), bridge_config(config)
 {
@@ -55,12 +61,55 @@ Adv_dbg_itf::Adv_dbg_itf(js::config *system_config, js::config *config, Log* log
   this->check_errors = conf != NULL ? conf->get_bool() : false;
   log->debug("Checking errors: %d\n", this->check_errors);
 
+
+  conf = config->get("**/write_combining");
+  if (conf != NULL)
+  {
+    js::config *enabled_conf = conf->get("enabled");
+    js::config *size_conf = conf->get("max_size");
+    js::config *delay_conf = conf->get("max_delay_us");
+    js::config *regions_conf = conf->get("ordered_regions");
+
+    this->wc_enabled = enabled_conf != NULL ? enabled_conf->get_bool() : true;
+    if (size_conf != NULL) this->wc_max_size = size_conf->get_int();
+    if (delay_conf != NULL) this->wc_max_delay = delay_conf->get_int();
+
+    // Writes to these regions (typically peripherals) are never merged and
+    // pending writes are flushed before any access to them, so that the
+    // order of device register accesses is preserved
+    if (regions_conf != NULL)
+    {
+      for (int i=0; i<regions_conf->get_size(); i++)
+      {
+        js::config *region = regions_conf->get_elem(i);
+        this->wc_ordered_regions.push_back(std::make_pair(
+          region->get("base")->get_int(), region->get("size")->get_int()));
+      }
+    }
+  }
+  log->debug("Write combining: %d (max_size: %d, max_delay: %d us)\n", this->wc_enabled, this->wc_max_size, this->wc_max_delay);
+
 }
 
 
 
 Adv_dbg_itf::~Adv_dbg_itf()
 {
+  if (this->io_thread)
+  {
+    this->io_mutex.lock();
+    this->io_end = true;
+    this->io_cond.notify_all();
+    this->io_mutex.unlock();
+    this->io_thread->join();
+    delete this->io_thread;
+  }
+
+  pthread_mutex_lock(&mutex);
+  this->wc_flush();
+  pthread_mutex_unlock(&mutex);
+
+  delete this->mem_map;
   delete m_dev;
 }
 
@@ -75,6 +124,10 @@ bool Adv_dbg_itf::connect()
     access_timeout = 1000000;
 
   log->debug ("Using access timeout: %d us\n", access_timeout);
+  this->cur_access_timeout = access_timeout;
+
+  if (this->mem_map == NULL)
+    this->mem_map = new Mem_map(this->get_config()->get("**/debug_bridge/memory_map"), log, access_timeout);
 
   this->check_cable();
 
@@ -119,6 +172,8 @@ bool Adv_dbg_itf::jtag_reset(bool active)
 
   pthread_mutex_lock(&mutex);
 
+  this->wc_flush();
+
   for (int i=0; i < m_jtag_devices.size(); i++)
   {
     m_jtag_devices[i].is_in_debug = false;
@@ -165,7 +220,10 @@ bool Adv_dbg_itf::chip_reset(bool active, int duration)
 
   pthread_mutex_lock(&mutex);
 
+  this->wc_flush();
+
   if (!m_dev->chip_reset(active, duration)) { result = false; goto end; };
+  this->reset_count++;
   // Wait some time so that we don't do any IO access after that while the chip
   // has not finished booting
   if (!active) usleep(10000);
@@ -187,6 +245,8 @@ bool Adv_dbg_itf::chip_config(uint32_t value)
 
   pthread_mutex_lock(&mutex);
 
+  this->wc_flush();
+
   if (!m_dev->chip_config(value)) { result = false; goto end; };
 
 end:
@@ -212,7 +272,456 @@ void Adv_dbg_itf::device_select(unsigned int i)
 }
 
 
+void Adv_dbg_itf::io_routine()
+{
+  std::unique_lock<std::mutex> lock(this->io_mutex);
+
+  while(1)
+  {
+    while (!this->io_end && this->io_reqs.empty())
+    {
+      if (this->io_wc_pending)
+      {
+        // Combined writes must not stay pending for longer than the
+        // configured delay, flush them if nothing else comes in meanwhile
+        if (this->io_cond.wait_until(lock, this->io_wc_deadline) == std::cv_status::timeout)
+        {
+          this->io_wc_pending = false;
+          lock.unlock();
+          pthread_mutex_lock(&mutex);
+          this->wc_flush();
+          m_dev->flush();
+          pthread_mutex_unlock(&mutex);
+          lock.lock();
+        }
+      }
+      else
+      {
+        this->io_cond.wait(lock);
+      }
+    }
+
+    if (this->io_reqs.empty())
+      break;
+
+    // Take everything which has been queued by all clients since the last
+    // round so that it goes to the cable in one go
+    std::queue<Cable_io_req *> reqs;
+    std::swap(reqs, this->io_reqs);
+    lock.unlock();
+
+    std::vector<std::pair<Cable_io_req *, bool>> done;
+
+    pthread_mutex_lock(&mutex);
+
+    while (!reqs.empty())
+    {
+      Cable_io_req *req = reqs.front();
+      reqs.pop();
+
+      bool result;
+      if (req->type == CABLE_IO_REQ_REG_ACCESS)
+        result = this->io_reg_access(req->write, req->addr, req->buffer, req->device);
+      else if (req->type == CABLE_IO_REQ_LIST)
+        result = this->io_access_list(req->list, req->device);
+      else if (req->type == CABLE_IO_REQ_FILL)
+        result = this->io_fill(req->addr, req->size, &req->pattern[0], req->pattern.size(), req->device);
+      else if (req->type == CABLE_IO_REQ_BARRIER)
+        result = this->wc_flush();
+      else
+        result = this->io_access(req->write, req->addr, req->size, req->buffer, req->device);
+
+      done.push_back(std::make_pair(req, result));
+    }
+
+    m_dev->flush();
+
+    pthread_mutex_unlock(&mutex);
+
+    for (auto &elem: done)
+    {
+      Cable_io_req *req = elem.first;
+      if (req->callback) req->callback(elem.second);
+      req->promise.set_value(elem.second);
+      delete req;
+    }
+
+    lock.lock();
+  }
+}
+
+
+
+bool Adv_dbg_itf::io_is_inline()
+{
+  // Accesses are executed directly by the caller if it is holding the cable
+  // lock, otherwise the IO thread would block on it, or if it is the IO
+  // thread itself (e.g. from a callback).
+  std::thread::id id = std::this_thread::get_id();
+  return this->lock_owner == id || this->io_thread_id == id;
+}
+
+
+
+void Adv_dbg_itf::io_start()
+{
+  // Must be called with the IO mutex locked
+  if (this->io_thread == NULL)
+  {
+    this->io_thread = new std::thread(&Adv_dbg_itf::io_routine, this);
+    this->io_thread_id = this->io_thread->get_id();
+  }
+}
+
+
+
+std::future<bool> Adv_dbg_itf::io_push(Cable_io_req *req)
+{
+  std::future<bool> result = req->promise.get_future();
+
+  std::unique_lock<std::mutex> lock(this->io_mutex);
+
+  this->io_start();
+
+  this->io_reqs.push(req);
+  this->io_cond.notify_all();
+
+  return result;
+}
+
+
+
+std::future<bool> Adv_dbg_itf::access_async(bool write, unsigned int addr, int size, char* buffer, int device, std::function<void(bool)> callback)
+{
+  if (this->io_is_inline())
+    return Cable::access_async(write, addr, size, buffer, device, callback);
+
+  Cable_io_req *req = new Cable_io_req();
+  req->type = CABLE_IO_REQ_ACCESS;
+  req->write = write;
+  req->addr = addr;
+  req->size = size;
+  req->buffer = buffer;
+  req->device = device;
+  req->callback = callback;
+
+  return this->io_push(req);
+}
+
+
+
+std::future<bool> Adv_dbg_itf::reg_access_async(bool write, unsigned int addr, char* buffer, int device, std::function<void(bool)> callback)
+{
+  if (this->io_is_inline())
+    return Cable::reg_access_async(write, addr, buffer, device, callback);
+
+  Cable_io_req *req = new Cable_io_req();
+  req->type = CABLE_IO_REQ_REG_ACCESS;
+  req->write = write;
+  req->addr = addr;
+  req->size = 4;
+  req->buffer = buffer;
+  req->device = device;
+  req->callback = callback;
+
+  return this->io_push(req);
+}
+
+
+
+bool Adv_dbg_itf::access_list(std::vector<Cable_io_elem> &list, int device)
+{
+  if (this->io_is_inline())
+    return this->io_access_list(list, device);
+
+  Cable_io_req *req = new Cable_io_req();
+  req->type = CABLE_IO_REQ_LIST;
+  req->list = list;
+  req->device = device;
+
+  return this->io_push(req).get();
+}
+
+
+
+bool Adv_dbg_itf::io_access_list(std::vector<Cable_io_elem> &list, int device)
+{
+  bool result = true;
+
+  pthread_mutex_lock(&mutex);
+
+  for (size_t i=0; i<list.size(); )
+  {
+    Cable_io_elem &first = list[i];
+
+    // Consecutive accesses in the same direction to contiguous addresses
+    // (e.g. the debug registers of a core) are merged into one burst
+    size_t end = i + 1;
+    int size = first.size;
+    while (end < list.size() && list[end].write == first.write &&
+      list[end].addr == first.addr + size && size + list[end].size <= READ_BURST_SIZE)
+    {
+      size += list[end].size;
+      end++;
+    }
+
+    if (end == i + 1)
+    {
+      result = this->io_access(first.write, first.addr, first.size, first.buffer, device) && result;
+    }
+    else
+    {
+      std::vector<char> burst(size);
+      int offset = 0;
+
+      if (first.write)
+      {
+        for (size_t j=i; j<end; j++)
+        {
+          memcpy(&burst[offset], list[j].buffer, list[j].size);
+          offset += list[j].size;
+        }
+      }
+
+      result = this->io_access(first.write, first.addr, size, burst.data(), device) && result;
+
+      if (!first.write)
+      {
+        for (size_t j=i; j<end; j++)
+        {
+          memcpy(list[j].buffer, &burst[offset], list[j].size);
+          offset += list[j].size;
+        }
+      }
+    }
+
+    i = end;
+  }
+
+  pthread_mutex_unlock(&mutex);
+
+  return result;
+}
+
+
+
+bool Adv_dbg_itf::fill(unsigned int addr, int size, const char* pattern, int pattern_len, int device)
+{
+  if (pattern_len <= 0)
+    return false;
+
+  if (this->io_is_inline())
+    return this->io_fill(addr, size, pattern, pattern_len, device);
+
+  Cable_io_req *req = new Cable_io_req();
+  req->type = CABLE_IO_REQ_FILL;
+  req->addr = addr;
+  req->size = size;
+  req->pattern.assign(pattern, pattern + pattern_len);
+  req->device = device;
+
+  return this->io_push(req).get();
+}
+
+
+
+bool Adv_dbg_itf::io_fill(unsigned int addr, int size, const char* pattern, int pattern_len, int device)
+{
+  bool result = true;
+  int timeout;
+
+  log->debug("Filling memory (addr: 0x%x, size: 0x%x, pattern_len: %d)\n", addr, size, pattern_len);
+
+  // The pattern is repeated once in a buffer big enough for one burst, plus
+  // one pattern so that a burst can start at any offset within the pattern.
+  // Each burst then directly streams from this buffer.
+  std::vector<char> chunk(FILL_BURST_SIZE + pattern_len);
+  for (int i=0; i<chunk.size(); i++)
+  {
+    chunk[i] = pattern[i % pattern_len];
+  }
+
+  this->check_connection();
+
+  pthread_mutex_lock(&mutex);
+
+  if (!this->mem_check(true, addr, size, &timeout))
+  {
+    pthread_mutex_unlock(&mutex);
+    return false;
+  }
+
+  if (this->wc_overlaps(addr, size))
+    result = this->wc_flush();
+
+  if (device != -1)
+    this->device_select(device);
+  else if (m_jtag_device_default != m_jtag_device_sel)
+    this->device_select(m_jtag_device_default);
+
+  jtag_debug();
+
+  this->cur_access_timeout = timeout;
+
+  int offset = 0;
+  while (size)
+  {
+    // Align the first burst so that all others are full aligned bursts
+    int iter_size = FILL_BURST_SIZE - (addr & 0x3);
+    if (iter_size > size) iter_size = size;
+
+    result = this->write(addr, iter_size, &chunk[offset % pattern_len]) && result;
+
+    addr += iter_size;
+    offset += iter_size;
+    size -= iter_size;
+  }
+
+  pthread_mutex_unlock(&mutex);
+
+  return result;
+}
+
+
+
+bool Adv_dbg_itf::barrier()
+{
+  if (this->io_is_inline())
+  {
+    pthread_mutex_lock(&mutex);
+    bool result = this->wc_flush();
+    m_dev->flush();
+    pthread_mutex_unlock(&mutex);
+    return result;
+  }
+
+  // Go through the IO queue so that the barrier is also ordered with the
+  // asynchronous accesses pushed before
+  Cable_io_req *req = new Cable_io_req();
+  req->type = CABLE_IO_REQ_BARRIER;
+
+  return this->io_push(req).get();
+}
+
+
+
+bool Adv_dbg_itf::wc_is_ordered(unsigned int addr, int size)
+{
+  for (auto &region: this->wc_ordered_regions)
+  {
+    if (addr < region.first + region.second && addr + size > region.first)
+      return true;
+  }
+  return this->mem_map != NULL && this->mem_map->is_ordered(addr, size);
+}
+
+
+
+bool Adv_dbg_itf::mem_check(bool write, unsigned int addr, int size, int *timeout)
+{
+  if (this->mem_map == NULL)
+  {
+    *timeout = this->access_timeout;
+    return true;
+  }
+
+  return this->mem_map->check(write, addr, size, timeout);
+}
+
+
+
+bool Adv_dbg_itf::wc_overlaps(unsigned int addr, int size)
+{
+  if (this->wc_data.empty())
+    return false;
+
+  return addr < this->wc_base + this->wc_data.size() && addr + size > this->wc_base;
+}
+
+
+
+bool Adv_dbg_itf::wc_write(unsigned int addr, int size, char* buffer)
+{
+  bool result = true;
+
+  if (!this->wc_data.empty())
+  {
+    unsigned int end = this->wc_base + this->wc_data.size();
+    unsigned int new_base = addr < this->wc_base ? addr : this->wc_base;
+    unsigned int new_end = addr + size > end ? addr + size : end;
+
+    // Merge the write into the pending burst if it is adjacent or overlapping
+    if (addr <= end && addr + size >= this->wc_base && new_end - new_base <= this->wc_max_size)
+    {
+      if (new_base < this->wc_base)
+        this->wc_data.insert(this->wc_data.begin(), this->wc_base - new_base, 0);
+
+      this->wc_base = new_base;
+      this->wc_data.resize(new_end - new_base);
+      memcpy(&this->wc_data[addr - new_base], buffer, size);
+
+      if (this->wc_data.size() >= this->wc_max_size)
+        return this->wc_flush();
+
+      return true;
+    }
+
+    result = this->wc_flush();
+  }
+
+  this->wc_base = addr;
+  this->wc_data.assign(buffer, buffer + size);
+
+  // Let the IO thread know when this burst must be flushed at the latest
+  std::unique_lock<std::mutex> lock(this->io_mutex);
+  this->io_wc_pending = true;
+  this->io_wc_deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(this->wc_max_delay);
+  this->io_start();
+  this->io_cond.notify_all();
+
+  return result;
+}
+
+
+
+bool Adv_dbg_itf::wc_flush()
+{
+  if (this->wc_data.empty())
+    return true;
+
+  // Take the data out first as selecting the device may reset the TAP, which
+  // would flush again
+  std::vector<char> data;
+  std::swap(data, this->wc_data);
+
+  if (!this->mem_check(true, this->wc_base, data.size(), &this->cur_access_timeout))
+    return false;
+
+  this->device_select(this->wc_device);
+  jtag_debug();
+
+  log->debug("Flushing combined writes (addr: 0x%x, size: %d)\n", this->wc_base, data.size());
+
+  bool result = this->write(this->wc_base, data.size(), &data[0]);
+  if (!result)
+    log->warning("Failed to flush combined writes (addr: 0x%x, size: %d)\n", this->wc_base, data.size());
+
+  return result;
+}
+
+
+
 bool Adv_dbg_itf::reg_access(bool write, unsigned int addr, char* buffer, int device)
+{
+  if (this->io_is_inline())
+    return this->io_reg_access(write, addr, buffer, device);
+
+  return this->reg_access_async(write, addr, buffer, device).get();
+}
+
+
+
+bool Adv_dbg_itf::io_reg_access(bool write, unsigned int addr, char* buffer, int device)
 {
   bool result;
 
@@ -220,6 +729,8 @@ bool Adv_dbg_itf::reg_access(bool write, unsigned int addr, char* buffer, int de
 
   pthread_mutex_lock(&mutex);
 
+  this->wc_flush();
+
   if (device != -1)
     this->device_select(device);
   else if (m_jtag_device_default != m_jtag_device_sel)
@@ -364,12 +875,50 @@ bool Adv_dbg_itf::reg_access_pulp(bool write, unsigned int addr, char* buffer)
 
 bool Adv_dbg_itf::access(bool wr, unsigned int addr, int size, char* buffer, int device)
 {
-  bool result;
+  if (this->io_is_inline())
+    return this->io_access(wr, addr, size, buffer, device);
+
+  return this->access_async(wr, addr, size, buffer, device).get();
+}
+
+
+
+bool Adv_dbg_itf::io_access(bool wr, unsigned int addr, int size, char* buffer, int device)
+{
+  bool result = true;
+  int timeout;
 
   this->check_connection();
 
   pthread_mutex_lock(&mutex);
 
+  // Accesses outside the memory map would just wait for the AXI timeout,
+  // reject them before doing any JTAG access
+  if (!this->mem_check(wr, addr, size, &timeout))
+  {
+    result = false;
+    goto end;
+  }
+
+  if (this->wc_enabled)
+  {
+    int wc_device = device != -1 ? device : m_jtag_device_default;
+    bool ordered = this->wc_is_ordered(addr, size);
+    bool combine = wr && !ordered && size < this->wc_max_size;
+
+    // Pending writes must reach the target before anything which could
+    // observe them or depend on their order
+    if (!this->wc_data.empty() && (wc_device != this->wc_device || ordered || (!combine && this->wc_overlaps(addr, size))))
+      result = this->wc_flush();
+
+    if (combine)
+    {
+      this->wc_device = wc_device;
+      result = this->wc_write(addr, size, buffer) && result;
+      goto end;
+    }
+  }
+
   if (device != -1)
     this->device_select(device);
   else if (m_jtag_device_default != m_jtag_device_sel)
@@ -377,11 +926,14 @@ bool Adv_dbg_itf::access(bool wr, unsigned int addr, int size, char* buffer, int
 
   jtag_debug();
 
+  this->cur_access_timeout = timeout;
+
   if (wr)
-    result = write(addr, size, buffer);
+    result = write(addr, size, buffer) && result;
   else
-    result = read(addr, size, buffer);
+    result = read(addr, size, buffer) && result;
 
+end:
   pthread_mutex_unlock(&mutex);
 
   return result;
@@ -389,6 +941,13 @@ bool Adv_dbg_itf::access(bool wr, unsigned int addr, int size, char* buffer, int
 
 
 
+int Adv_dbg_itf::get_burst_size()
+{
+  return READ_BURST_SIZE;
+}
+
+
+
 bool Adv_dbg_itf::write(unsigned int _addr, int _size, char* _buffer)
 {
   int count = 0;
@@ -539,7 +1098,7 @@ bool Adv_dbg_itf::read(unsigned int _addr, int _size, char* _buffer)
       while (local_size)
       {
         int iter_size = local_size;
-        if (iter_size > 2048) iter_size = 2048  ;
+        if (iter_size > READ_BURST_SIZE) iter_size = READ_BURST_SIZE;
 
         retval = retval && read_internal(32, addr, iter_size, buffer);
         local_size   -= iter_size;
@@ -814,10 +1373,9 @@ bool Adv_dbg_itf::read_internal_pulp(int bitwidth, unsigned int addr, int size,
 
   // no need to do padding here, we just wait for a 1
 
-  // wait for a '1' from the AXI module
-  struct timeval start, now;
-  int retval = gettimeofday(&start, NULL);
-  assert(retval == 0);
+  // wait for a '1' from the AXI module, each try is already a round-trip
+  // with the cable, thus there is no delay between them
+  Poll_backoff backoff(cur_access_timeout);
 
   while (true) {
     buf[0] = 0x0;
@@ -829,12 +1387,8 @@ bool Adv_dbg_itf::read_internal_pulp(int bitwidth, unsigned int addr, int size,
     if (buf[0] & 0x1)
       break;
 
-    retval = gettimeofday(&now, NULL);
-    assert(retval == 0);
-    unsigned long usec_elapsed = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_usec - start.tv_usec);
-
-    if (usec_elapsed > access_timeout) {
-      log->warning("ft2232: did not get a start bit from the AXI module in 1s\n");
+    if (!backoff.wait()) {
+      log->warning("ft2232: did not get a start bit from the AXI module (timeout: %d us)\n", cur_access_timeout);
       return false;
     }
   }
@@ -1373,6 +1927,8 @@ bool Adv_dbg_itf::bit_inout(char* inbit, char outbit, bool last)
 
   pthread_mutex_lock(&mutex);
 
+  this->wc_flush();
+
   // Invalidate debug mode in case the caller is sending raw bitstream as it might
   // change the IR
   if (m_jtag_device_sel < m_jtag_devices.size())
@@ -1390,6 +1946,8 @@ bool Adv_dbg_itf::stream_inout(char* instream, char* outstream, unsigned int n_b
 
   pthread_mutex_lock(&mutex);
 
+  this->wc_flush();
+
   // Invalidate debug mode in case the caller is sending raw bitstream as it might
   // change the IR
   if (m_jtag_device_sel < m_jtag_devices.size())
@@ -1405,6 +1963,8 @@ int Adv_dbg_itf::flush()
 {
   pthread_mutex_lock(&mutex);
 
+  this->wc_flush();
+
   bool result = m_dev->flush();
 
   pthread_mutex_unlock(&mutex);
@@ -1415,9 +1975,13 @@ int Adv_dbg_itf::flush()
 void Adv_dbg_itf::lock()
 {
   pthread_mutex_lock(&mutex);
+  if (this->lock_depth++ == 0)
+    this->lock_owner = std::this_thread::get_id();
 }
 
 void Adv_dbg_itf::unlock()
 {
+  if (--this->lock_depth == 0)
+    this->lock_owner = std::thread::id();
   pthread_mutex_unlock(&mutex);
 }
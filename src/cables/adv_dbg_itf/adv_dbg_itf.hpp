@@ -20,9 +20,16 @@
 #define __CABLES_ADV_DBG_ITF_ADV_DBG_ITF_HPP__
 
 #include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
 #include <stdint.h>
 
 #include "cables/log.h"
+#include "cables/mem_map.hpp"
 #include "cable.hpp"
 
 class FTDILL;
@@ -38,6 +45,30 @@ struct jtag_device {
   int protocol;
 };
 
+typedef enum
+{
+  CABLE_IO_REQ_ACCESS,
+  CABLE_IO_REQ_REG_ACCESS,
+  CABLE_IO_REQ_FILL,
+  CABLE_IO_REQ_LIST,
+  CABLE_IO_REQ_BARRIER
+} cable_io_req_type_e;
+
+class Cable_io_req
+{
+public:
+  cable_io_req_type_e type;
+  bool write;
+  unsigned int addr;
+  int size;
+  char *buffer;
+  int device;
+  std::vector<char> pattern;
+  std::vector<Cable_io_elem> list;
+  std::promise<bool> promise;
+  std::function<void(bool)> callback;
+};
+
 class Adv_dbg_itf : public Cable  {
   public:
     Adv_dbg_itf(js::config *system_config, js::config *config, Log* log, Cable *itf);
@@ -51,6 +82,21 @@ class Adv_dbg_itf : public Cable  {
     bool access(bool write, unsigned int addr, int size, char* buffer, int device=-1);
     bool reg_access(bool write, unsigned int addr, char* buffer, int device=-1);
 
+    std::future<bool> access_async(bool write, unsigned int addr, int size, char* buffer, int device=-1, std::function<void(bool)> callback=nullptr);
+    std::future<bool> reg_access_async(bool write, unsigned int addr, char* buffer, int device=-1, std::function<void(bool)> callback=nullptr);
+
+    bool access_list(std::vector<Cable_io_elem> &list, int device=-1);
+
+    bool fill(unsigned int addr, int size, const char* pattern, int pattern_len, int device=-1);
+
+    int get_burst_size();
+
+    bool barrier();
+
+    Mem_map *get_mem_map() { return this->mem_map; }
+
+    unsigned int get_reset_count() { return this->reset_count; }
+
     void device_select(unsigned int i);
 
     void add_device(int ir_len, int protocol=DEV_PROTOCOL_PULP);
@@ -87,10 +133,40 @@ class Adv_dbg_itf : public Cable  {
     bool connected = false;
 
     pthread_mutex_t mutex;
+    std::atomic<std::thread::id> lock_owner{std::thread::id()};
+    int lock_depth = 0;
+
+    // Accesses are queued here and executed by the IO thread, which owns the
+    // cable and pushes everything which is pending in one go
+    std::thread *io_thread = NULL;
+    std::thread::id io_thread_id;
+    std::mutex io_mutex;
+    std::condition_variable io_cond;
+    std::queue<Cable_io_req *> io_reqs;
+    bool io_end = false;
+    bool io_wc_pending = false;
+    std::chrono::steady_clock::time_point io_wc_deadline;
+
+    // Write-combining buffer. Small writes are merged into one pending burst
+    // as long as they are adjacent or overlapping
+    bool wc_enabled = false;
+    int wc_max_size = 1024;
+    int wc_max_delay = 1000;
+    std::vector<std::pair<unsigned int, unsigned int>> wc_ordered_regions;
+    unsigned int wc_base;
+    int wc_device = 0;
+    std::vector<char> wc_data;
+
     unsigned int debug_ir;
     int retry_count;
     int check_errors;
     int access_timeout;
+    // Timeout of the access being done, which depends on the memory region
+    int cur_access_timeout;
+
+    Mem_map *mem_map = NULL;
+
+    std::atomic<unsigned int> reset_count{0};
 
 
     std::vector<jtag_device> m_jtag_devices;
@@ -101,6 +177,22 @@ class Adv_dbg_itf : public Cable  {
 
     js::config *bridge_config;
 
+    void io_routine();
+    bool io_is_inline();
+    std::future<bool> io_push(Cable_io_req *req);
+    bool io_access(bool write, unsigned int addr, int size, char* buffer, int device);
+    bool io_reg_access(bool write, unsigned int addr, char* buffer, int device);
+    bool io_access_list(std::vector<Cable_io_elem> &list, int device);
+    bool io_fill(unsigned int addr, int size, const char* pattern, int pattern_len, int device);
+    void io_start();
+
+    bool mem_check(bool write, unsigned int addr, int size, int *timeout);
+
+    bool wc_is_ordered(unsigned int addr, int size);
+    bool wc_overlaps(unsigned int addr, int size);
+    bool wc_write(unsigned int addr, int size, char* buffer);
+    bool wc_flush();
+
     bool reg_access_pulp(bool write, unsigned int addr, char* buffer);
 
     bool reg_access_riscv(bool write, unsigned int addr, char* buffer);
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2018 ETH Zurich and University of Bologna
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+
+#include "cables/mem_map.hpp"
+
+
+Mem_map::Mem_map(js::config *config, Log *log, int default_timeout) : log(log), default_timeout(default_timeout)
+{
+  if (config == NULL)
+    return;
+
+  for (auto &x: config->get_childs())
+  {
+    js::config *region_config = x.second;
+    js::config *conf;
+
+    Mem_region *region = new Mem_region();
+    region->name = x.first;
+    region->base = region_config->get("base")->get_int();
+    region->size = region_config->get("size")->get_int();
+
+    conf = region_config->get("access");
+    if (conf != NULL)
+    {
+      std::string access = conf->get_str();
+      region->readable = access.find('r') != std::string::npos;
+      region->writable = access.find('w') != std::string::npos;
+    }
+
+    conf = region_config->get("ordered");
+    if (conf != NULL) region->ordered = conf->get_bool();
+
+    conf = region_config->get("cacheable");
+    if (conf != NULL) region->cacheable = conf->get_bool();
+
+    conf = region_config->get("timeout_us");
+    region->timeout = conf != NULL ? conf->get_int() : default_timeout;
+
+    log->debug("Adding memory region (name: %s, base: 0x%x, size: 0x%x, read: %d, write: %d, timeout: %d us)\n",
+      region->name.c_str(), region->base, region->size, region->readable, region->writable, region->timeout);
+
+    this->regions.push_back(region);
+  }
+
+  std::sort(this->regions.begin(), this->regions.end(),
+    [](Mem_region *a, Mem_region *b) { return a->base < b->base; });
+}
+
+
+
+Mem_map::~Mem_map()
+{
+  for (auto region: this->regions)
+  {
+    delete region;
+  }
+}
+
+
+
+Mem_region *Mem_map::get_region(unsigned int addr)
+{
+  for (auto region: this->regions)
+  {
+    if (addr - region->base < region->size)
+      return region;
+  }
+
+  return NULL;
+}
+
+
+
+bool Mem_map::check(bool write, unsigned int addr, int size, int *timeout)
+{
+  *timeout = this->default_timeout;
+
+  if (this->is_empty())
+    return true;
+
+  // The access may span several contiguous regions, the longest timeout
+  // is then used for the whole access
+  int max_timeout = 0;
+  unsigned int current = addr;
+  int remaining = size;
+
+  do
+  {
+    Mem_region *region = this->get_region(current);
+
+    if (region == NULL)
+    {
+      log->debug("Rejecting access to unmapped address (addr: 0x%x, size: 0x%x)\n", addr, size);
+      return false;
+    }
+
+    if ((write && !region->writable) || (!write && !region->readable))
+    {
+      log->debug("Rejecting access not allowed by memory region (region: %s, addr: 0x%x, size: 0x%x, write: %d)\n",
+        region->name.c_str(), addr, size, write);
+      return false;
+    }
+
+    if (region->timeout > max_timeout)
+      max_timeout = region->timeout;
+
+    unsigned int iter_size = region->base + region->size - current;
+    if (iter_size >= (unsigned int)remaining)
+      break;
+
+    current += iter_size;
+    remaining -= iter_size;
+  }
+  while (remaining > 0);
+
+  *timeout = max_timeout;
+
+  return true;
+}
+
+
+
+bool Mem_map::is_ordered(unsigned int addr, int size)
+{
+  for (auto region: this->regions)
+  {
+    if (region->ordered && addr < region->base + region->size && addr + size > region->base)
+      return true;
+  }
+  return false;
+}
+
+
+
+bool Mem_map::is_cacheable(unsigned int addr, int size)
+{
+  if (size <= 0)
+    return false;
+
+  unsigned int current = addr;
+  int remaining = size;
+
+  while (remaining > 0)
+  {
+    Mem_region *region = this->get_region(current);
+    if (region == NULL || !region->cacheable)
+      return false;
+
+    unsigned int iter_size = region->base + region->size - current;
+    if (iter_size >= (unsigned int)remaining)
+      break;
+
+    current += iter_size;
+    remaining -= iter_size;
+  }
+
+  return true;
+}
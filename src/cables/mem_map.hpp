@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2018 ETH Zurich and University of Bologna
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __CABLES_MEM_MAP_HPP__
+#define __CABLES_MEM_MAP_HPP__
+
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+#include "cables/log.h"
+
+class Mem_region {
+public:
+  std::string name;
+  unsigned int base;
+  unsigned int size;
+  bool readable = true;
+  bool writable = true;
+  // Peripheral-like region, accesses must not be merged or reordered
+  bool ordered = false;
+  // Region whose content can only change through the debug bridge while
+  // the cores are halted, and can thus be cached
+  bool cacheable = false;
+  // Time to wait for the AXI module to answer, in us
+  int timeout;
+};
+
+// Describes the memory regions of the target, so that accesses to unmapped
+// addresses are rejected before generating any JTAG traffic.
+// When no map is configured, every access is allowed.
+class Mem_map {
+public:
+  Mem_map(js::config *config, Log *log, int default_timeout);
+  ~Mem_map();
+
+  bool is_empty() { return this->regions.size() == 0; }
+
+  // Returns the region containing addr, or NULL
+  Mem_region *get_region(unsigned int addr);
+
+  // Checks that [addr, addr+size[ is fully covered by mapped regions which
+  // allow this kind of access. The timeout to be used for the access is
+  // returned in timeout
+  bool check(bool write, unsigned int addr, int size, int *timeout);
+
+  // Returns true if any part of the range is in an ordered region
+  bool is_ordered(unsigned int addr, int size);
+
+  // Returns true if the whole range is in cacheable regions
+  bool is_cacheable(unsigned int addr, int size);
+
+private:
+  Log *log;
+  int default_timeout;
+  std::vector<Mem_region *> regions;
+};
+
+#endif
@@ -0,0 +1,296 @@
+/*
+ * Copyright (C) 2018 ETH Zurich and University of Bologna
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "gdb-server/gdb-server.hpp"
+
+// Opcodes of the GDB agent expressions, see "Bytecode Descriptions" in the
+// GDB manual. Tracing and floating-point opcodes are not supported.
+#define AX_ADD           0x02
+#define AX_SUB           0x03
+#define AX_MUL           0x04
+#define AX_DIV_SIGNED    0x05
+#define AX_DIV_UNSIGNED  0x06
+#define AX_REM_SIGNED    0x07
+#define AX_REM_UNSIGNED  0x08
+#define AX_LSH           0x09
+#define AX_RSH_SIGNED    0x0a
+#define AX_RSH_UNSIGNED  0x0b
+#define AX_LOG_NOT       0x0e
+#define AX_BIT_AND       0x0f
+#define AX_BIT_OR        0x10
+#define AX_BIT_XOR       0x11
+#define AX_BIT_NOT       0x12
+#define AX_EQUAL         0x13
+#define AX_LESS_SIGNED   0x14
+#define AX_LESS_UNSIGNED 0x15
+#define AX_EXT           0x16
+#define AX_REF8          0x17
+#define AX_REF16         0x18
+#define AX_REF32         0x19
+#define AX_REF64         0x1a
+#define AX_IF_GOTO       0x20
+#define AX_GOTO          0x21
+#define AX_CONST8        0x22
+#define AX_CONST16       0x23
+#define AX_CONST32       0x24
+#define AX_CONST64       0x25
+#define AX_REG           0x26
+#define AX_END           0x27
+#define AX_DUP           0x28
+#define AX_POP           0x29
+#define AX_ZERO_EXT      0x2a
+#define AX_SWAP          0x2b
+#define AX_PICK          0x32
+#define AX_ROT           0x33
+
+#define AX_STACK_SIZE    64
+// Bounds the execution of expressions with backward jumps
+#define AX_MAX_STEPS     10000
+
+// GDB register number of the PC, after the 32 GPRs
+#define AX_REG_PC        32
+
+
+Agent_expr::Agent_expr(Gdb_server *top, Target_core *core) : top(top), core(core)
+{
+}
+
+
+
+bool Agent_expr::read_reg(int reg, int64_t *value)
+{
+  uint32_t data;
+
+  if (reg < 32) {
+    if (!this->core->gpr_read(reg, &data))
+      return false;
+  } else if (reg == AX_REG_PC) {
+    if (!this->core->pc_read(&data))
+      return false;
+  } else {
+    top->log->warning("Unsupported register in breakpoint condition (reg: %d)\n", reg);
+    return false;
+  }
+
+  *value = data;
+  return true;
+}
+
+
+
+bool Agent_expr::read_mem(uint64_t addr, int size, int64_t *value)
+{
+  uint64_t data = 0;
+
+  // The memory is read through the cache, and the breakpoints patched in
+  // memory must not be seen
+  if (!top->mem_cache->read(addr, size, (char *)&data))
+    return false;
+
+  top->bkp->shadow(addr, size, (char *)&data);
+
+  *value = data;
+  return true;
+}
+
+
+
+bool Agent_expr::eval(std::vector<uint8_t> &code, int64_t *result)
+{
+  int64_t stack[AX_STACK_SIZE];
+  int sp = 0;
+  int pc = 0;
+  int steps = 0;
+
+#define AX_NEED(n) do { if (sp < (n)) goto error; } while(0)
+#define AX_ARGS(n) do { if (pc + (n) > code.size()) goto error; } while(0)
+#define AX_PUSH(v) do { int64_t value = (v); if (sp == AX_STACK_SIZE) goto error; stack[sp++] = value; } while(0)
+
+  while (pc < code.size())
+  {
+    uint8_t opcode = code[pc++];
+    int64_t a, b;
+    uint64_t imm;
+
+    if (++steps > AX_MAX_STEPS)
+      goto error;
+
+    // Binary operators work on the 2 top elements, b being on top
+    if (opcode >= AX_ADD && opcode <= AX_LESS_UNSIGNED && opcode != AX_LOG_NOT && opcode != AX_BIT_NOT)
+    {
+      AX_NEED(2);
+      a = stack[sp - 2];
+      b = stack[sp - 1];
+      sp--;
+    }
+
+    switch (opcode)
+    {
+      case AX_ADD: stack[sp - 1] = a + b; break;
+      case AX_SUB: stack[sp - 1] = a - b; break;
+      case AX_MUL: stack[sp - 1] = a * b; break;
+      case AX_DIV_SIGNED:
+        if (b == 0) goto error;
+        stack[sp - 1] = a / b;
+        break;
+      case AX_DIV_UNSIGNED:
+        if (b == 0) goto error;
+        stack[sp - 1] = (uint64_t)a / (uint64_t)b;
+        break;
+      case AX_REM_SIGNED:
+        if (b == 0) goto error;
+        stack[sp - 1] = a % b;
+        break;
+      case AX_REM_UNSIGNED:
+        if (b == 0) goto error;
+        stack[sp - 1] = (uint64_t)a % (uint64_t)b;
+        break;
+      case AX_LSH: stack[sp - 1] = (uint64_t)a << b; break;
+      case AX_RSH_SIGNED: stack[sp - 1] = a >> b; break;
+      case AX_RSH_UNSIGNED: stack[sp - 1] = (uint64_t)a >> b; break;
+      case AX_BIT_AND: stack[sp - 1] = a & b; break;
+      case AX_BIT_OR: stack[sp - 1] = a | b; break;
+      case AX_BIT_XOR: stack[sp - 1] = a ^ b; break;
+      case AX_EQUAL: stack[sp - 1] = a == b; break;
+      case AX_LESS_SIGNED: stack[sp - 1] = a < b; break;
+      case AX_LESS_UNSIGNED: stack[sp - 1] = (uint64_t)a < (uint64_t)b; break;
+
+      case AX_LOG_NOT:
+        AX_NEED(1);
+        stack[sp - 1] = !stack[sp - 1];
+        break;
+
+      case AX_BIT_NOT:
+        AX_NEED(1);
+        stack[sp - 1] = ~stack[sp - 1];
+        break;
+
+      case AX_EXT:
+      case AX_ZERO_EXT:
+      {
+        AX_ARGS(1);
+        AX_NEED(1);
+        int bits = code[pc++];
+        if (bits < 64)
+        {
+          uint64_t mask = (1ULL << bits) - 1;
+          uint64_t value = stack[sp - 1] & mask;
+          if (opcode == AX_EXT && bits > 0 && (value >> (bits - 1)) & 1)
+            value |= ~mask;
+          stack[sp - 1] = value;
+        }
+        break;
+      }
+
+      case AX_REF8:
+      case AX_REF16:
+      case AX_REF32:
+      case AX_REF64:
+        AX_NEED(1);
+        if (!this->read_mem(stack[sp - 1], 1 << (opcode - AX_REF8), &stack[sp - 1]))
+          goto error;
+        break;
+
+      case AX_IF_GOTO:
+      case AX_GOTO:
+        AX_ARGS(2);
+        imm = (code[pc] << 8) | code[pc + 1];
+        pc += 2;
+        if (opcode == AX_GOTO) {
+          pc = imm;
+        } else {
+          AX_NEED(1);
+          if (stack[--sp])
+            pc = imm;
+        }
+        break;
+
+      case AX_CONST8:
+      case AX_CONST16:
+      case AX_CONST32:
+      case AX_CONST64:
+      {
+        // Constants are big-endian and zero-extended
+        int size = 1 << (opcode - AX_CONST8);
+        AX_ARGS(size);
+        imm = 0;
+        for (int i=0; i<size; i++)
+          imm = (imm << 8) | code[pc++];
+        AX_PUSH(imm);
+        break;
+      }
+
+      case AX_REG:
+        AX_ARGS(2);
+        imm = (code[pc] << 8) | code[pc + 1];
+        pc += 2;
+        if (!this->read_reg(imm, &a))
+          goto error;
+        AX_PUSH(a);
+        break;
+
+      case AX_END:
+        AX_NEED(1);
+        *result = stack[sp - 1];
+        return true;
+
+      case AX_DUP:
+        AX_NEED(1);
+        AX_PUSH(stack[sp - 1]);
+        break;
+
+      case AX_POP:
+        AX_NEED(1);
+        sp--;
+        break;
+
+      case AX_SWAP:
+        AX_NEED(2);
+        a = stack[sp - 1];
+        stack[sp - 1] = stack[sp - 2];
+        stack[sp - 2] = a;
+        break;
+
+      case AX_PICK:
+        AX_ARGS(1);
+        imm = code[pc++];
+        AX_NEED(imm + 1);
+        AX_PUSH(stack[sp - 1 - imm]);
+        break;
+
+      case AX_ROT:
+        // a b c => c a b
+        AX_NEED(3);
+        a = stack[sp - 1];
+        stack[sp - 1] = stack[sp - 2];
+        stack[sp - 2] = stack[sp - 3];
+        stack[sp - 3] = a;
+        break;
+
+      default:
+        top->log->warning("Unsupported opcode in breakpoint condition (opcode: 0x%x)\n", opcode);
+        goto error;
+    }
+  }
+
+error:
+  top->log->debug("Failed to evaluate breakpoint condition (pc: %d)\n", pc);
+  return false;
+
+#undef AX_NEED
+#undef AX_ARGS
+#undef AX_PUSH
+}
@@ -34,77 +34,167 @@ Breakpoints::Breakpoints(Gdb_server *top)
 
 bool
 Breakpoints::insert(unsigned int addr) {
-  bool retval;
-  uint32_t data_bp;
-  struct bp_insn bp;
+  this->wanted.insert(addr);
+  this->dirty = true;
+  return true;
+}
 
-  bp.addr = addr;
-  retval = top->cable->access(false, addr, 4, (char*)&bp.insn_orig);
-  bp.is_compressed = INSN_IS_COMPRESSED(bp.insn_orig);
+bool
+Breakpoints::remove(unsigned int addr) {
+  if (this->wanted.erase(addr) == 0)
+    return false;
 
-  breakpoints.push_back(bp);
+  this->dirty = true;
+  return true;
+}
 
-  if (bp.is_compressed) {
-    data_bp = INSN_BP_COMPRESSED;
-    retval = retval && top->cable->access(true, addr, 2, (char*)&data_bp);
-  } else {
-    data_bp = INSN_BP;
-    retval = retval && top->cable->access(true, addr, 4, (char*)&data_bp);
+bool
+Breakpoints::commit() {
+  if (!this->dirty)
+    return true;
+
+  this->dirty = false;
+
+  std::vector<unsigned int> to_remove;
+  std::vector<struct bp_insn> to_add;
+
+  for (auto &it: this->installed) {
+    if (this->wanted.count(it.first) == 0)
+      to_remove.push_back(it.first);
   }
 
-  this->top->target->flush();
+  for (auto addr: this->wanted) {
+    if (this->installed.count(addr) == 0) {
+      struct bp_insn bp;
+      bp.addr = addr;
+      to_add.push_back(bp);
+    }
+  }
 
-  return retval;
-}
+  if (to_remove.size() == 0 && to_add.size() == 0)
+    return true;
 
-bool
-Breakpoints::remove(unsigned int addr) {
+  top->log->debug("Committing breakpoints (removed: %d, added: %d)\n", to_remove.size(), to_add.size());
 
-  bool retval;
-  bool is_compressed;
-  uint32_t data;
-  for (std::list<struct bp_insn>::iterator it = breakpoints.begin(); it != breakpoints.end(); it++) {
-    if (it->addr == addr) {
-      data = it->insn_orig;
-      is_compressed = it->is_compressed;
+  // Original instructions of the new breakpoints
+  std::vector<Cable_io_elem> list;
 
-      breakpoints.erase(it);
+  for (auto &bp: to_add) {
+    list.push_back(Cable_io_elem(false, bp.addr, 4, (char *)&bp.insn_orig));
+  }
 
-      if (is_compressed)
-        retval = top->cable->access(true, addr, 2, (char*)&data);
-      else
-        retval = top->cable->access(true, addr, 4, (char*)&data);
+  if (list.size() && !top->cable->access_list(list)) {
+    top->log->error("Failed to read instructions for breakpoints\n");
+    this->dirty = true;
+    return false;
+  }
 
-      this->top->target->flush();
+  // Patch the memory in one go
+  uint32_t insn_bp = INSN_BP;
+  uint32_t insn_bp_compressed = INSN_BP_COMPRESSED;
 
-      return retval;
-    }
+  list.clear();
+
+  for (auto addr: to_remove) {
+    struct bp_insn *bp = &this->installed[addr];
+    list.push_back(Cable_io_elem(true, addr, bp->is_compressed ? 2 : 4, (char *)&bp->insn_orig));
   }
 
-  return false;
-}
+  for (auto &bp: to_add) {
+    bp.is_compressed = INSN_IS_COMPRESSED(bp.insn_orig);
+    if (bp.is_compressed)
+      list.push_back(Cable_io_elem(true, bp.addr, 2, (char *)&insn_bp_compressed));
+    else
+      list.push_back(Cable_io_elem(true, bp.addr, 4, (char *)&insn_bp));
+  }
 
-bool
-Breakpoints::clear() {
+  bool retval = top->cable->access_list(list);
+
+  for (auto addr: to_remove) {
+    this->installed.erase(addr);
+    this->top->mem_cache->invalidate(addr, 4);
+  }
 
-  bool retval = this->disable_all();
+  // Memory like ROM or XIP flash silently ignores the write, check that the
+  // instructions are really there
+  std::vector<uint32_t> check(to_add.size(), 0);
 
-  breakpoints.clear();
+  list.clear();
+
+  for (int i=0; i<to_add.size(); i++) {
+    list.push_back(Cable_io_elem(false, to_add[i].addr, to_add[i].is_compressed ? 2 : 4, (char *)&check[i]));
+  }
+
+  if (list.size() && !top->cable->access_list(list))
+    retval = false;
+
+  for (int i=0; i<to_add.size(); i++) {
+    struct bp_insn *bp = &to_add[i];
+    uint32_t expected = bp->is_compressed ? insn_bp_compressed : insn_bp;
+
+    this->top->mem_cache->invalidate(bp->addr, 4);
+
+    if (check[i] == expected) {
+      this->installed[bp->addr] = *bp;
+    } else {
+      top->log->warning("Could not patch memory for breakpoint, using a hardware one (addr: 0x%x)\n", bp->addr);
+      this->wanted.erase(bp->addr);
+      if (!this->insert_hw(BP_HARDWARE, bp->addr)) {
+        top->log->error("Could not set breakpoint (addr: 0x%x)\n", bp->addr);
+        retval = false;
+      }
+    }
+  }
+
+  this->top->target->flush();
 
   return retval;
 }
 
+void
+Breakpoints::shadow(unsigned int addr, int size, char *buffer) {
+  for (auto &it: this->installed) {
+    struct bp_insn *bp = &it.second;
+    int bp_size = bp->is_compressed ? 2 : 4;
 
-bool
-Breakpoints::at_addr(unsigned int addr) {
-  for (std::list<struct bp_insn>::iterator it = breakpoints.begin(); it != breakpoints.end(); it++) {
-    if (it->addr == addr) {
-      // we found our bp
-      return true;
+    if (bp->addr + bp_size <= addr || bp->addr >= addr + size)
+      continue;
+
+    for (int i=0; i<bp_size; i++) {
+      if (bp->addr + i >= addr && bp->addr + i < addr + size)
+        buffer[bp->addr + i - addr] = ((char *)&bp->insn_orig)[i];
     }
   }
+}
 
-  return false;
+void
+Breakpoints::written(unsigned int addr, int size) {
+  for (auto it = this->installed.begin(); it != this->installed.end();) {
+    struct bp_insn *bp = &it->second;
+    int bp_size = bp->is_compressed ? 2 : 4;
+
+    if (bp->addr + bp_size <= addr || bp->addr >= addr + size) {
+      it++;
+    } else {
+      // The breakpoint is gone, it is installed again with the new
+      // instruction by the next commit if it is still wanted
+      it = this->installed.erase(it);
+      this->dirty = true;
+    }
+  }
+}
+
+bool
+Breakpoints::clear() {
+  this->wanted.clear();
+  this->dirty = true;
+  return this->commit();
+}
+
+
+bool
+Breakpoints::at_addr(unsigned int addr) {
+  return this->installed.count(addr) != 0;
 }
 
 bool
@@ -112,53 +202,51 @@ Breakpoints::enable(unsigned int addr) {
   bool retval;
   uint32_t data;
 
-  for (std::list<struct bp_insn>::iterator it = breakpoints.begin(); it != breakpoints.end(); it++) {
-    if (it->addr == addr) {
-      if (it->is_compressed) {
-        data = INSN_BP_COMPRESSED;
-        retval = top->cable->access(1, addr, 2, (char*)&data);
-      } else {
-        data = INSN_BP;
-        retval = top->cable->access(1, addr, 4, (char*)&data);
-      }
+  auto it = this->installed.find(addr);
+  if (it == this->installed.end()) {
+    fprintf(stderr, "bp_enable: Did not find any bp at addr %08X\n", addr);
+    return false;
+  }
 
-      return true;
-      //return retval && m_cache->flush();
-    }
+  if (it->second.is_compressed) {
+    data = INSN_BP_COMPRESSED;
+    retval = top->cable->access(1, addr, 2, (char*)&data);
+  } else {
+    data = INSN_BP;
+    retval = top->cable->access(1, addr, 4, (char*)&data);
   }
 
-  fprintf(stderr, "bp_enable: Did not find any bp at addr %08X\n", addr);
+  this->top->mem_cache->invalidate(addr, 4);
 
-  return false;
+  return retval;
 }
 
 bool
 Breakpoints::disable(unsigned int addr) {
   bool retval;
 
-  for (std::list<struct bp_insn>::iterator it = breakpoints.begin(); it != breakpoints.end(); it++) {
-    if (it->addr == addr) {
-      if (it->is_compressed)
-        retval = top->cable->access(1, addr, 2, (char*)&it->insn_orig);
-      else
-        retval = top->cable->access(1, addr, 4, (char*)&it->insn_orig);
-
-      return true;
-      //return retval && m_cache->flush();
-    }
+  auto it = this->installed.find(addr);
+  if (it == this->installed.end()) {
+    fprintf(stderr, "bp_disable: Did not find any bp at addr %08X\n", addr);
+    return false;
   }
 
-  fprintf(stderr, "bp_enable: Did not find any bp at addr %08X\n", addr);
+  if (it->second.is_compressed)
+    retval = top->cable->access(1, addr, 2, (char*)&it->second.insn_orig);
+  else
+    retval = top->cable->access(1, addr, 4, (char*)&it->second.insn_orig);
+
+  this->top->mem_cache->invalidate(addr, 4);
 
-  return false;
+  return retval;
 }
 
 bool
 Breakpoints::enable_all() {
   bool retval = true;
 
-  for (std::list<struct bp_insn>::iterator it = breakpoints.begin(); it != breakpoints.end(); it++) {
-    retval = retval && this->enable(it->addr);
+  for (auto &it: this->installed) {
+    retval = retval && this->enable(it.first);
   }
 
   return retval;
@@ -168,8 +256,72 @@ bool
 Breakpoints::disable_all() {
   bool retval = true;
 
-  for (std::list<struct bp_insn>::iterator it = breakpoints.begin(); it != breakpoints.end(); it++) {
-    retval = retval && this->disable(it->addr);
+  for (auto &it: this->installed) {
+    retval = retval && this->disable(it.first);
+  }
+
+  return retval;
+}
+
+
+
+void
+Breakpoints::set_conditions(unsigned int addr, std::vector<std::vector<uint8_t>> &conditions) {
+  if (conditions.size() == 0)
+    this->conditions.erase(addr);
+  else
+    this->conditions[addr] = conditions;
+}
+
+std::vector<std::vector<uint8_t>> *
+Breakpoints::get_conditions(unsigned int addr) {
+  auto it = this->conditions.find(addr);
+  if (it == this->conditions.end())
+    return NULL;
+  return &it->second;
+}
+
+
+
+bool
+Breakpoints::has_hw() {
+  // Hardware breakpoints and watchpoints need a trigger on each core, see
+  // insert_hw
+  if (top->target->get_threads().size() == 0)
+    return false;
+
+  for (auto &core: top->target->get_threads()) {
+    if (!core->has_triggers())
+      return false;
+  }
+
+  return true;
+}
+
+bool
+Breakpoints::insert_hw(int type, unsigned int addr) {
+  std::vector<Target_core *> done;
+
+  // Breakpoints apply to all threads, thus a trigger is needed on each core
+  for (auto &core: top->target->get_threads()) {
+    if (!core->trigger_insert(type, addr)) {
+      for (auto &done_core: done) {
+        done_core->trigger_remove(type, addr);
+      }
+      return false;
+    }
+    done.push_back(core);
+  }
+
+  return true;
+}
+
+bool
+Breakpoints::remove_hw(int type, unsigned int addr) {
+  bool retval = false;
+
+  for (auto &core: top->target->get_threads()) {
+    retval = core->trigger_remove(type, addr) || retval;
   }
 
   return retval;
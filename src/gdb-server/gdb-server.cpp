@@ -26,6 +26,8 @@
 Gdb_server::Gdb_server(Log *log, Cable *cable, js::config *config, int socket_port)
 : log(log), cable(cable), config(config)
 {
+  mem_cache = new Mem_cache(this);
+
   target = new Target(this);
 
   bkp = new Breakpoints(this);
@@ -42,6 +44,13 @@ int Gdb_server::stop(bool kill)
     rsp->close(kill);
     rsp = NULL;
   }
+
+  // Only the RSP thread was using the cache
+  if (mem_cache != NULL)
+  {
+    delete mem_cache;
+    mem_cache = NULL;
+  }
 }
 
 void Gdb_server::print(const char *format, ...)
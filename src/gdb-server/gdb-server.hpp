@@ -21,7 +21,14 @@
 #ifndef __GDB_SERVER_GDB_SERVER_H__
 #define __GDB_SERVER_GDB_SERVER_H__
 
+#include <atomic>
 #include <list>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <string>
+#include <vector>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -33,9 +40,11 @@
 #include <string.h>
 #include <sys/select.h>
 #include <thread>
+#include <chrono>
 
 #include "cable.hpp"
 #include "json.hpp"
+#include "cables/mem_map.hpp"
 
 #define DBG_CTRL_REG  0x0
 #define DBG_HIT_REG   0x4
@@ -46,8 +55,21 @@
 
 #define DBG_CAUSE_BP  0x3
 
+// Time given to a core to halt after a single-step
+#define DBG_HALT_TIMEOUT_US 100000
+
+enum mp_type {
+  BP_MEMORY   = 0,
+  BP_HARDWARE = 1,
+  WP_WRITE    = 2,
+  WP_READ     = 3,
+  WP_ACCESS   = 4
+};
+
 
 class Rsp;
+class Rsp_client;
+class Mem_cache;
 class Breakpoints;
 class Target;
 class Target_cluster_common;
@@ -68,6 +90,7 @@ public:
   Cable *cable;
   Target *target;
   Breakpoints *bkp;
+  Mem_cache *mem_cache;
 
   js::config *config;
 };
@@ -75,10 +98,75 @@ public:
 
 
 
+// Write-through cache of the target memory, used to serve the memory reads
+// of GDB while the cores are halted. Only the regions declared cacheable in
+// the memory map are cached, and everything is dropped as soon as the target
+// may modify its memory.
+class Mem_cache_fetch
+{
+public:
+  uint32_t addr;
+  std::vector<char> data;
+  std::future<bool> result;
+};
+
+class Mem_cache
+{
+public:
+  Mem_cache(Gdb_server *top);
+  ~Mem_cache();
+
+  bool read(uint32_t addr, int size, char *buffer);
+  bool write(uint32_t addr, int size, char *buffer);
+
+  void invalidate();
+  void invalidate(uint32_t addr, int size);
+
+  // While some cores are running (non-stop mode), the memory can change at
+  // any time and must not be cached
+  void set_bypass(bool bypass);
+
+  // Starts fetching the memory GDB will most likely read after a stop,
+  // around the PC and the SP. This is asynchronous, the blocks are added
+  // to the cache on the next access.
+  void prefetch_stop(uint32_t pc, uint32_t sp);
+  void prefetch(uint32_t addr, int size);
+
+private:
+  bool is_cacheable(uint32_t addr, int size);
+  void prefetch_wait();
+
+  Gdb_server *top;
+  Mem_map *mem_map;
+  bool enabled;
+  unsigned int block_size;
+  unsigned int reset_count;
+  std::map<uint32_t, std::vector<char>> blocks;
+  std::list<Mem_cache_fetch *> fetches;
+  bool bypass = false;
+  int pc_window;
+  int sp_window;
+};
+
+
+
+// Hardware trigger of a core debug unit, used for hardware breakpoints and
+// watchpoints
+class Target_core_trigger
+{
+public:
+  bool used = false;
+  bool enabled = true;
+  int type;
+  uint32_t addr;
+};
+
+
+
 class Target_core
 {
 public:
-  Target_core(Gdb_server *top, uint32_t dbg_unit_addr, int cluster_id, int core_id);
+  Target_core(Gdb_server *top, uint32_t dbg_unit_addr, int cluster_id, int core_id, js::config *config=NULL);
   void set_power(bool is_on);
   bool read(uint32_t addr, uint32_t* rdata);
   bool write(uint32_t addr, uint32_t wdata);
@@ -88,10 +176,19 @@ public:
     snprintf(str, len, "Cluster %02d - Core %01d", this->cluster_id, this->core_id);
   }
   bool is_stopped();
+  bool get_stopped() { return stopped; }
+  void poll_prepare(std::vector<Cable_io_elem> &list);
+  void poll_update();
+  // Sets the halt status when it is read for all cores of the cluster
+  void poll_set_stopped(bool stopped);
   void read_ppc(uint32_t *ppc);
+  bool pc_read(uint32_t *pc);
+  bool npc_write(uint32_t npc);
 
   bool stop();
   bool halt();
+  // Waits until the core is halted, e.g. after a single-step
+  bool wait_halted();
   void prepare_resume(bool step=false);
   void commit_resume();
   void set_step_mode(bool new_step);
@@ -99,11 +196,48 @@ public:
   void resume();
   void flush();
 
+  // Run control of several cores is done with a single cable access list,
+  // each core adds its accesses to the list, in the order they must be done
+  void halt_prepare(std::vector<Cable_io_elem> &list);
+  void resume_prepare(std::vector<Cable_io_elem> &list, bool commit_only);
+  // PCs needed by prepare_resume, fetched for all cores at once
+  void resume_pcs_prepare(std::vector<Cable_io_elem> &list);
+  void resume_pcs_update(bool valid);
+
+  // Single-steps the stopped core as long as it stays in [start, end[, for
+  // at most max_steps steps. Returns false if the core is still in the range
+  // once they are all done.
+  bool range_step(uint32_t start, uint32_t end, int max_steps);
+
   bool gpr_read_all(uint32_t *data);
   bool gpr_read(unsigned int i, uint32_t *data);
   bool gpr_write(unsigned int i, uint32_t data);
 
+  // The registers of a stopped core are fetched all together in one cable
+  // access list and kept until the core is resumed. Register writes from GDB
+  // are kept in the snapshot and written back when resuming.
+  bool snapshot();
+  bool snapshot_write_back();
+  void snapshot_write_back_prepare(std::vector<Cable_io_elem> &list);
+  void snapshot_invalidate();
+
+  // Triggers are declared in the core configuration (debug_triggers), the
+  // type is one of mp_type
+  bool has_triggers() { return triggers.size() != 0; }
+  bool trigger_insert(int type, uint32_t addr);
+  bool trigger_remove(int type, uint32_t addr);
+  bool trigger_at(uint32_t addr);
+  void trigger_enable(uint32_t addr, bool enabled);
+  // Returns the type of the watchpoint trigger which stopped the core, with
+  // its address in addr, or -1 if none can be found
+  int trigger_watch_hit(uint32_t *addr);
+
 private:
+  bool trigger_apply(int index);
+
+  bool read_hw(uint32_t addr, uint32_t* rdata);
+  uint32_t *snapshot_reg(uint32_t addr);
+
   Gdb_server *top;
   bool is_on = false;
   uint32_t dbg_unit_addr;
@@ -111,11 +245,34 @@ private:
   int cluster_id;
   int core_id;
   int thread_id;
-  bool ppc_is_cached = false;
-  uint32_t ppc_cached;
   bool stopped = false;
+  bool polled = false;
+  uint32_t poll_ctrl;
   bool step = false;
   bool commit_step = false;
+  uint32_t run_ctrl;
+  uint32_t run_hit = 0;
+  uint32_t resume_ppc;
+  uint32_t resume_npc;
+  bool resume_pcs_pending = false;
+  bool resume_pcs_valid = false;
+
+  bool snapshot_valid = false;
+  uint32_t snapshot_dbg_regs[4];
+  uint32_t snapshot_pcs[2];
+  uint32_t snapshot_gprs[32];
+  std::vector<unsigned int> snapshot_csr_ids;
+  std::vector<uint32_t> snapshot_csrs;
+  uint32_t snapshot_gprs_dirty = 0;
+  bool snapshot_npc_dirty = false;
+
+  std::vector<Target_core_trigger> triggers;
+  uint32_t trigger_base;
+  uint32_t trigger_stride;
+  uint32_t trigger_addr_offset;
+  uint32_t trigger_ctrl_offset;
+  uint32_t trigger_ctrl[WP_ACCESS + 1];
+  uint32_t trigger_hit_mask = 0;
 };
 
 
@@ -129,12 +286,19 @@ public:
 
   void halt();
   void resume(bool step=false, int tid=-1);
+  // Fetches the PCs needed to prepare the resume of all cores in one go
+  void resume_pcs_fetch();
   void resume_all();
+  void set_non_stop(bool non_stop);
   bool wait(int socket_client);
   void flush();
 
   void update_power();
 
+  // Gets the power state of all clusters and the status of all cores with
+  // a single cable access list
+  void poll();
+
   std::vector<Target_core *> get_threads() { return cores; }
   Target_core *get_thread(int thread_id) { return cores_from_threadid[thread_id]; }
   Target_core *get_thread_from_id(int id) { return cores[id]; }
@@ -157,12 +321,30 @@ struct bp_insn {
 
 
 
+// GDB removes and inserts again all the breakpoints around each stop, thus
+// insert and remove only update the set of wanted breakpoints. The memory is
+// patched by commit with the difference against the installed ones, before
+// cores are resumed.
 class Breakpoints {
   public:
     Breakpoints(Gdb_server *top);
 
     bool insert(unsigned int addr);
     bool remove(unsigned int addr);
+    bool commit();
+
+    // Puts back the original instructions of the installed breakpoints in a
+    // buffer read from memory, GDB must not see them while they are removed
+    void shadow(unsigned int addr, int size, char *buffer);
+    // Must be called when memory is written, as installed breakpoints may
+    // have been overwritten
+    void written(unsigned int addr, int size);
+
+    // Hardware breakpoints and watchpoints, set on all cores. They are only
+    // available if all cores have triggers.
+    bool has_hw();
+    bool insert_hw(int type, unsigned int addr);
+    bool remove_hw(int type, unsigned int addr);
 
     bool clear();
 
@@ -174,11 +356,94 @@ class Breakpoints {
     bool disable(unsigned int addr);
     bool enable(unsigned int addr);
 
+    // Conditions are agent expressions given by GDB with the breakpoint, the
+    // target stops if any of them is true
+    void set_conditions(unsigned int addr, std::vector<std::vector<uint8_t>> &conditions);
+    std::vector<std::vector<uint8_t>> *get_conditions(unsigned int addr);
+
   private:
-    std::list<struct bp_insn> breakpoints;
+    std::unordered_map<unsigned int, std::vector<std::vector<uint8_t>>> conditions;
+    std::unordered_set<unsigned int> wanted;
+    std::unordered_map<unsigned int, struct bp_insn> installed;
+    bool dirty = false;
     Gdb_server *top;
 };
 
+// Evaluates the GDB agent expressions used for breakpoint conditions, using
+// the registers of a stopped core and the memory through the cache
+class Agent_expr
+{
+public:
+  Agent_expr(Gdb_server *top, Target_core *core);
+
+  // Returns false if the expression could not be evaluated
+  bool eval(std::vector<uint8_t> &code, int64_t *result);
+
+private:
+  bool read_reg(int reg, int64_t *value);
+  bool read_mem(uint64_t addr, int size, int64_t *value);
+
+  Gdb_server *top;
+  Target_core *core;
+};
+
+// Connection with one GDB client. Incoming data is read by chunks into a
+// buffer from which packets are parsed, and outgoing data is accumulated
+// until it is flushed, to limit the number of system calls per packet.
+class Rsp_client
+{
+public:
+  Rsp_client(Log *log, int socket, int thread_sel);
+  ~Rsp_client();
+
+  int get_socket() { return socket; }
+
+  // Appends what is available on the socket to the input buffer, returns
+  // false if the connection is closed
+  bool receive();
+
+  void put(const char *data, size_t len);
+  bool flush();
+
+  // Set once GDB has requested QStartNoAckMode
+  bool no_ack = false;
+
+  int thread_sel;
+
+  // Set while the target is running on behalf of this client, which is then
+  // waiting for a stop reply
+  bool running = false;
+  Target_core *wait_core = NULL;
+
+  // Non-stop mode, cores are resumed and stopped individually and stops are
+  // reported with notifications
+  bool non_stop = false;
+  std::set<Target_core *> running_cores;
+  std::set<Target_core *> stop_requested;
+  std::list<std::string> stop_replies;
+
+  // Range stepping (vCont;r), the core is stepped by the bridge until it
+  // leaves [range_start, range_end[
+  Target_core *range_core = NULL;
+  uint32_t range_start;
+  uint32_t range_end;
+
+  bool is_waiting() { return running || running_cores.size(); }
+
+  std::vector<char> in_buffer;
+  size_t in_pos = 0;
+
+  // Kept for retransmission when GDB answers with a NACK
+  std::vector<char> last_packet;
+
+private:
+  Log *log;
+  int socket;
+  std::vector<char> out_buffer;
+};
+
+
+
 class Rsp {
   public:
     Rsp(Gdb_server *top, int socket_port);
@@ -190,56 +455,73 @@ class Rsp {
 
   private:
 
-    bool decode(int socket_client, char* data, size_t len);
-    bool get_packet(int socket_client, char* data, size_t* len);
+    bool decode(Rsp_client *client, char* data, size_t len);
+    int get_packet(Rsp_client *client, std::vector<char> &pkt, size_t* len);
 
-    void client_routine(int socket_client);
-    void listener_routine();
+    void loop_routine();
+    void client_accept();
+    bool client_handle(Rsp_client *client);
+    void client_close(Rsp_client *client);
+    void check_stop();
+    bool interrupt(Rsp_client *client);
+    int get_signal(Target_core *core);
+    int bp_condition(Target_core *core);
+    int stop_reply(Target_core *core, int signal, bool thread, char *str, int size);
+    bool range_continue(Rsp_client *client, Target_core *core);
+    bool non_stop_resume(Rsp_client *client, Target_core *core, bool step);
+    bool non_stop_status(Rsp_client *client);
+    void update_cache_bypass();
 
 
-    bool regs_send(int socket_client);
-    bool signal(int socket_client);
+    bool regs_send(Rsp_client *client);
+    bool signal(Rsp_client *client);
 
-    bool multithread(int socket_client, char* data, size_t len);
+    bool multithread(Rsp_client *client, char* data, size_t len);
 
-    bool v_packet(int socket_client, char* data, size_t len);
+    bool v_packet(Rsp_client *client, char* data, size_t len);
 
-    bool query(int socket_client, char* data, size_t len);
+    bool query(Rsp_client *client, char* data, size_t len);
 
-    bool send(int socket_client, const char* data, size_t len);
-    bool send_str(int socket_client, const char* data);
+    bool send(Rsp_client *client, const char* data, size_t len, bool notification=false);
+    bool send_str(Rsp_client *client, const char* data);
 
-    bool cont(int socket_client, char* data, size_t len); // continue, reserved keyword, thus not used as function name
-    bool resume(int socket_client, bool step);
-    bool resume(int socket_client, int tid, bool step);
-    bool wait(int socket_client, Target_core *core=NULL);
-    bool step(int socket_client, char* data, size_t len);
+    bool cont(Rsp_client *client, char* data, size_t len); // continue, reserved keyword, thus not used as function name
+    bool resume(Rsp_client *client, bool step);
+    bool resume(Rsp_client *client, int tid, bool step);
+    bool wait(Rsp_client *client, Target_core *core=NULL);
+    bool step(Rsp_client *client, char* data, size_t len);
 
     // internal helper functions
-    bool pc_read(int socket_client, unsigned int* pc);
+    bool pc_read(Rsp_client *client, unsigned int* pc);
 
-    bool reg_read(int socket_client, char* data, size_t len);
-    bool reg_write(int socket_client, char* data, size_t len);
+    bool reg_read(Rsp_client *client, char* data, size_t len);
+    bool reg_write(Rsp_client *client, char* data, size_t len);
 
-    bool mem_read(int socket_client, char* data, size_t len);
-    bool mem_write_ascii(int socket_client, char* data, size_t len);
-    bool mem_write(int socket_client, char* data, size_t len);
+    bool mem_read(Rsp_client *client, char* data, size_t len);
+    bool mem_write_ascii(Rsp_client *client, char* data, size_t len);
+    bool mem_write(Rsp_client *client, char* data, size_t len);
 
-    bool bp_insert(int socket_client, char* data, size_t len);
-    bool bp_remove(int socket_client, char* data, size_t len);
+    bool bp_insert(Rsp_client *client, char* data, size_t len);
+    bool bp_remove(Rsp_client *client, char* data, size_t len);
 
     Gdb_server *top;
     int socket_port;
     int socket_in;
-    std::thread *listener_thread;
-
-    int thread_sel;
-    Target_core *main_core = NULL;
+    std::thread *loop_thread;
 
+    // All clients are served from a single thread waiting on this epoll
+    // instance, which can be woken-up through the pipe
+    int epoll_fd;
+    int wake_pipe[2];
+    std::atomic<bool> loop_end{false};
+    std::map<int, Rsp_client *> clients;
 
+    Target_core *main_core = NULL;
 
-    bool wait_client();
-    bool loop();
+    int poll_min;
+    int poll_max;
+    int poll_interval;
+    std::chrono::steady_clock::time_point poll_next;
 
 
 
@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2018 ETH Zurich and University of Bologna
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "gdb-server/gdb-server.hpp"
+
+
+Mem_cache::Mem_cache(Gdb_server *top) : top(top)
+{
+  js::config *config = top->config->get("**/gdb_server/mem_cache");
+  js::config *conf;
+
+  conf = config != NULL ? config->get("enabled") : NULL;
+  this->enabled = conf != NULL ? conf->get_bool() : true;
+
+  conf = config != NULL ? config->get("block_size") : NULL;
+  this->block_size = conf != NULL ? conf->get_int() : 256;
+
+  if (this->block_size == 0 || (this->block_size & (this->block_size - 1)))
+  {
+    top->log->warning("Memory cache block size must be a power of 2, disabling cache (block_size: %d)\n", this->block_size);
+    this->enabled = false;
+    this->block_size = 256;
+  }
+
+  conf = config != NULL ? config->get("prefetch_pc_window") : NULL;
+  this->pc_window = conf != NULL ? conf->get_int() : 256;
+
+  conf = config != NULL ? config->get("prefetch_sp_window") : NULL;
+  this->sp_window = conf != NULL ? conf->get_int() : 512;
+
+  // The cacheable regions are the ones declared as such in the memory map,
+  // without memory map nothing is cached
+  this->mem_map = new Mem_map(top->config->get("**/debug_bridge/memory_map"), top->log, 0);
+
+  this->reset_count = top->cable->get_reset_count();
+
+  top->log->debug("Memory cache (enabled: %d, block_size: %d, pc_window: %d, sp_window: %d)\n", this->enabled, this->block_size, this->pc_window, this->sp_window);
+}
+
+
+
+Mem_cache::~Mem_cache()
+{
+  // Prefetches still in flight are writing to their buffers
+  for (auto fetch: this->fetches)
+  {
+    fetch->result.wait();
+    delete fetch;
+  }
+
+  this->fetches.clear();
+  this->blocks.clear();
+  delete this->mem_map;
+}
+
+
+
+bool Mem_cache::is_cacheable(uint32_t addr, int size)
+{
+  return this->enabled && this->mem_map->is_cacheable(addr, size);
+}
+
+
+
+void Mem_cache::set_bypass(bool bypass)
+{
+  if (bypass && !this->bypass)
+    this->invalidate();
+
+  this->bypass = bypass;
+}
+
+
+
+void Mem_cache::prefetch_stop(uint32_t pc, uint32_t sp)
+{
+  // Code is disassembled on both sides of the PC while the stack is unwound
+  // from the SP towards higher addresses
+  if (this->pc_window > 0)
+  {
+    uint32_t half = this->pc_window / 2;
+    uint32_t base = pc > half ? pc - half : 0;
+    this->prefetch(base, this->pc_window);
+  }
+
+  if (this->sp_window > 0)
+    this->prefetch(sp, this->sp_window);
+}
+
+
+
+void Mem_cache::prefetch(uint32_t addr, int size)
+{
+  if (size <= 0 || !this->enabled || this->bypass)
+    return;
+
+  uint32_t first = addr & ~(this->block_size - 1);
+  int nb_blocks = ((addr + size - 1 - first) / this->block_size) + 1;
+
+  // Only prefetch the blocks which are not there yet, one access for each
+  // group of consecutive missing blocks
+  int i = 0;
+  while (i < nb_blocks)
+  {
+    uint32_t block = first + i * this->block_size;
+    if (this->blocks.find(block) != this->blocks.end() || !this->is_cacheable(block, this->block_size))
+    {
+      i++;
+      continue;
+    }
+
+    int j = i + 1;
+    while (j < nb_blocks)
+    {
+      uint32_t next = first + j * this->block_size;
+      if (this->blocks.find(next) != this->blocks.end() || !this->is_cacheable(next, this->block_size))
+        break;
+      j++;
+    }
+
+    Mem_cache_fetch *fetch = new Mem_cache_fetch();
+    fetch->addr = block;
+    fetch->data.resize((j - i) * this->block_size);
+
+    top->log->debug("Prefetching memory (addr: 0x%x, size: 0x%x)\n", fetch->addr, fetch->data.size());
+
+    fetch->result = top->cable->access_async(false, fetch->addr, fetch->data.size(), &fetch->data[0]);
+    this->fetches.push_back(fetch);
+
+    i = j;
+  }
+}
+
+
+
+void Mem_cache::prefetch_wait()
+{
+  for (auto fetch: this->fetches)
+  {
+    if (fetch->result.get())
+    {
+      for (int i=0; i<fetch->data.size(); i+=this->block_size)
+      {
+        // Do not override blocks which were fetched or written meanwhile
+        uint32_t block = fetch->addr + i;
+        if (this->blocks.find(block) == this->blocks.end())
+          this->blocks[block].assign(&fetch->data[i], &fetch->data[i] + this->block_size);
+      }
+    }
+
+    delete fetch;
+  }
+
+  this->fetches.clear();
+}
+
+
+
+bool Mem_cache::read(uint32_t addr, int size, char *buffer)
+{
+  // A chip reset can happen behind our back while the cores are halted
+  unsigned int reset_count = this->top->cable->get_reset_count();
+  if (reset_count != this->reset_count)
+  {
+    this->reset_count = reset_count;
+    this->invalidate();
+  }
+
+  this->prefetch_wait();
+
+  if (size <= 0)
+    return true;
+
+  if (this->bypass)
+    return top->cable->access(false, addr, size, buffer);
+
+  uint32_t first = addr & ~(this->block_size - 1);
+  int nb_blocks = ((addr + size - 1 - first) / this->block_size) + 1;
+
+  if (!this->is_cacheable(first, nb_blocks * this->block_size))
+    return top->cable->access(false, addr, size, buffer);
+
+  // Fetch the missing blocks, consecutive ones with a single access
+  int i = 0;
+  while (i < nb_blocks)
+  {
+    if (this->blocks.find(first + i * this->block_size) != this->blocks.end())
+    {
+      i++;
+      continue;
+    }
+
+    int j = i + 1;
+    while (j < nb_blocks && this->blocks.find(first + j * this->block_size) == this->blocks.end())
+      j++;
+
+    uint32_t fetch_addr = first + i * this->block_size;
+    std::vector<char> data((j - i) * this->block_size);
+
+    top->log->debug("Filling memory cache (addr: 0x%x, size: 0x%x)\n", fetch_addr, data.size());
+
+    if (!top->cable->access(false, fetch_addr, data.size(), &data[0]))
+      return false;
+
+    for (int k = i; k < j; k++)
+    {
+      char *block_data = &data[(k - i) * this->block_size];
+      this->blocks[first + k * this->block_size].assign(block_data, block_data + this->block_size);
+    }
+
+    i = j;
+  }
+
+  // Now everything is in the cache
+  while (size > 0)
+  {
+    uint32_t block = addr & ~(this->block_size - 1);
+    int offset = addr - block;
+    int iter_size = this->block_size - offset;
+    if (iter_size > size) iter_size = size;
+
+    memcpy(buffer, &this->blocks[block][offset], iter_size);
+
+    addr += iter_size;
+    buffer += iter_size;
+    size -= iter_size;
+  }
+
+  return true;
+}
+
+
+
+bool Mem_cache::write(uint32_t addr, int size, char *buffer)
+{
+  this->prefetch_wait();
+
+  bool result = top->cable->access(true, addr, size, buffer);
+
+  if (!result)
+  {
+    this->invalidate(addr, size);
+    return false;
+  }
+
+  // Write-through, just update the blocks we already have
+  while (size > 0)
+  {
+    uint32_t block = addr & ~(this->block_size - 1);
+    int offset = addr - block;
+    int iter_size = this->block_size - offset;
+    if (iter_size > size) iter_size = size;
+
+    auto it = this->blocks.find(block);
+    if (it != this->blocks.end())
+      memcpy(&it->second[offset], buffer, iter_size);
+
+    addr += iter_size;
+    buffer += iter_size;
+    size -= iter_size;
+  }
+
+  return true;
+}
+
+
+
+void Mem_cache::invalidate()
+{
+  // The buffers of pending fetches must stay valid until they are done
+  this->prefetch_wait();
+
+  if (this->blocks.size())
+    top->log->debug("Invalidating memory cache\n");
+
+  this->blocks.clear();
+}
+
+
+
+void Mem_cache::invalidate(uint32_t addr, int size)
+{
+  if (size <= 0)
+    return;
+
+  this->prefetch_wait();
+
+  uint32_t first = addr & ~(this->block_size - 1);
+  uint32_t last = (addr + size - 1) & ~(this->block_size - 1);
+
+  this->blocks.erase(this->blocks.lower_bound(first), this->blocks.upper_bound(last));
+}
@@ -30,17 +30,11 @@
 #include <fcntl.h>
 #include <string.h>
 #include <sys/select.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 #include "gdb-server.hpp"
 #include <unistd.h>
 
-enum mp_type {
-  BP_MEMORY   = 0,
-  BP_HARDWARE = 1,
-  WP_WRITE    = 2,
-  WP_READ     = 3,
-  WP_ACCESS   = 4
-};
-
 enum target_signal {
   TARGET_SIGNAL_NONE =  0,
   TARGET_SIGNAL_INT  =  2,
@@ -55,7 +49,87 @@ enum target_signal {
   TARGET_SIGNAL_PWR  = 32
 };
 
-#define PACKET_MAX_LEN 4096
+// Maximum packet size advertised to GDB. Buffers are allocated dynamically,
+// this just bounds what a client can send.
+#define PACKET_MAX_LEN 0x4000
+// Number of steps done in a row for range stepping before going back to the
+// event loop
+#define RANGE_STEP_BATCH 256
+
+
+Rsp_client::Rsp_client(Log *log, int socket, int thread_sel) : thread_sel(thread_sel), log(log), socket(socket)
+{
+  // Packets are small and always flushed as a whole, don't let them wait
+  int yes = 1;
+  if (setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1)
+    log->warning("Unable to set TCP_NODELAY on client socket: %s\n", strerror(errno));
+}
+
+
+
+Rsp_client::~Rsp_client()
+{
+  ::close(socket);
+}
+
+
+
+bool Rsp_client::receive()
+{
+  // Drop what has already been parsed
+  if (this->in_pos != 0)
+  {
+    this->in_buffer.erase(this->in_buffer.begin(), this->in_buffer.begin() + this->in_pos);
+    this->in_pos = 0;
+  }
+
+  char buffer[4096];
+  int ret = recv(socket, buffer, sizeof(buffer), 0);
+
+  if (ret == -1 && (errno == EWOULDBLOCK || errno == EINTR))
+    return true;
+
+  if (ret <= 0)
+    return false;
+
+  this->in_buffer.insert(this->in_buffer.end(), buffer, buffer + ret);
+
+  return true;
+}
+
+
+
+void Rsp_client::put(const char *data, size_t len)
+{
+  this->out_buffer.insert(this->out_buffer.end(), data, data + len);
+}
+
+
+
+bool Rsp_client::flush()
+{
+  size_t done = 0;
+  while (done < this->out_buffer.size())
+  {
+    int ret = ::send(socket, &this->out_buffer[done], this->out_buffer.size() - done, 0);
+    if (ret == -1 && errno == EINTR)
+      continue;
+
+    if (ret <= 0)
+    {
+      log->print(LOG_ERROR, "Unable to send data to client\n");
+      this->out_buffer.clear();
+      return false;
+    }
+
+    done += ret;
+  }
+
+  this->out_buffer.clear();
+
+  return true;
+}
+
 
 
 Rsp::Rsp(Gdb_server *top, int socket_port) : top(top), socket_port(socket_port)
@@ -63,19 +137,35 @@ Rsp::Rsp(Gdb_server *top, int socket_port) : top(top), socket_port(socket_port)
   main_core = top->target->get_threads().front();
 
   m_thread_init = main_core->get_thread_id();
-  thread_sel = m_thread_init;
+
+  js::config *conf = top->config->get("**/gdb_server/poll_min_us");
+  poll_min = conf != NULL ? conf->get_int() : 1000;
+  conf = top->config->get("**/gdb_server/poll_max_us");
+  poll_max = conf != NULL ? conf->get_int() : 100000;
+  poll_interval = poll_min;
 }
 
-bool Rsp::v_packet(int socket_client, char* data, size_t len)
+bool Rsp::v_packet(Rsp_client *client, char* data, size_t len)
 {
   if (strncmp ("vKill", data, strlen ("vKill")) == 0)
   {
-    this->send_str(socket_client,  "OK");
+    this->send_str(client,  "OK");
     return false;
   }
   else if (strncmp ("vCont?", data, strlen ("vCont?")) == 0)
   {
-    return this->send_str(socket_client,  "vCont;c;s;C;S");
+    return this->send_str(client,  "vCont;c;s;C;S;t;r");
+  }
+  else if (strncmp ("vStopped", data, strlen ("vStopped")) == 0)
+  {
+    // GDB got the previous stop reply, send the next one if any
+    if (client->stop_replies.size())
+      client->stop_replies.pop_front();
+
+    if (client->stop_replies.size())
+      return this->send_str(client, client->stop_replies.front().c_str());
+
+    return this->send_str(client, "OK");
   }
   else if (strncmp ("vCont", data, strlen ("vCont")) == 0)
   {
@@ -85,6 +175,11 @@ bool Rsp::v_packet(int socket_client, char* data, size_t len)
     {
       thread_done[i] = false;
     }
+    client->range_core = NULL;
+
+    if (!client->non_stop)
+      this->top->target->resume_pcs_fetch();
+
     // vCont can contains several commands, handle them in sequence
       char *str = strtok(&data[6], ";");
     while(str != NULL) {
@@ -94,21 +189,51 @@ bool Rsp::v_packet(int socket_client, char* data, size_t len)
       if (delim != NULL) {
         tid = atoi(delim+1);
         *delim = 0;
-        thread_sel = tid;
+        client->thread_sel = tid;
       }
 
       bool cont = false;
       bool step = false;
 
+      if (str[0] == 't' && client->non_stop) {
+        // Stop the thread, this is reported with signal 0 once it is halted
+        for (int i=0; i<nb_threads; i++)
+        {
+          Target_core *core = this->top->target->get_thread_from_id(i);
+          if ((tid == -1 || core->get_thread_id() == tid) && !thread_done[i] && client->running_cores.count(core))
+          {
+            thread_done[i] = true;
+            client->stop_requested.insert(core);
+            core->halt();
+          }
+        }
+
+        str = strtok(NULL, ";");
+        continue;
+      }
+
       if (str[0] == 'C' || str[0] == 'c') {
         cont = true;
         step = false;
       } else if (str[0] == 'S' || str[0] == 's') {
         cont = true;
         step = true;
+      } else if (str[0] == 'r') {
+        // The first step is a normal one, the next ones are done by the
+        // bridge when the core is found stopped
+        Target_core *core = this->top->target->get_thread(tid == -1 ? client->thread_sel : tid);
+        if (sscanf(str, "r%x,%x", &client->range_start, &client->range_end) != 2) {
+          top->log->print(LOG_ERROR, "Could not parse range in vCont packet: %s\n", str);
+          return this->send_str(client, "E01");
+        }
+        client->range_core = core;
+        tid = core->get_thread_id();
+        cont = true;
+        step = true;
       } else {
+        // Also covers stopping threads in all-stop mode
         top->log->print(LOG_ERROR, "Unsupported command in vCont packet: %s\n", str);
-        exit(-1);
+        return this->send_str(client, "E01");
       }
 
       if (cont) {
@@ -118,14 +243,20 @@ bool Rsp::v_packet(int socket_client, char* data, size_t len)
             if (!thread_done[i])
             {
               thread_done[i] = true;
-              this->top->target->get_thread_from_id(i)->prepare_resume(step);
+              if (client->non_stop)
+                this->non_stop_resume(client, this->top->target->get_thread_from_id(i), step);
+              else
+                this->top->target->get_thread_from_id(i)->prepare_resume(step);
             }
           }
         } else {
           if (!thread_done[tid])
           {
             thread_done[tid] = true;
-            this->top->target->get_thread(tid)->prepare_resume(step);
+            if (client->non_stop)
+              this->non_stop_resume(client, this->top->target->get_thread(tid), step);
+            else
+              this->top->target->get_thread(tid)->prepare_resume(step);
           }
         }
       }
@@ -133,27 +264,37 @@ bool Rsp::v_packet(int socket_client, char* data, size_t len)
       str = strtok(NULL, ";");
     }
 
+    if (client->non_stop)
+    {
+      // Stops are reported asynchronously through notifications
+      this->update_cache_bypass();
+      this->poll_interval = poll_min;
+      this->poll_next = std::chrono::steady_clock::now();
+      return this->send_str(client, "OK");
+    }
+
     this->top->target->resume_all();
 
-    return this->wait(socket_client);
+    return this->wait(client);
   }
 
-  return this->send_str(socket_client,  "");
+  return this->send_str(client,  "");
 }
 
-bool Rsp::query(int socket_client, char* data, size_t len)
+bool Rsp::query(Rsp_client *client, char* data, size_t len)
 {
   int ret;
   char reply[256];
 
   if (strncmp ("qSupported", data, strlen ("qSupported")) == 0)
   {
-    return this->send_str(socket_client,  "PacketSize=256");
+    snprintf(reply, 256, "PacketSize=%x;QStartNoAckMode+;QNonStop+;ConditionalBreakpoints+", PACKET_MAX_LEN);
+    return this->send_str(client, reply);
   }
   else if (strncmp ("qTStatus", data, strlen ("qTStatus")) == 0)
   {
     // not supported, send empty packet
-    return this->send_str(socket_client,  "");
+    return this->send_str(client,  "");
   }
   else if (strncmp ("qfThreadInfo", data, strlen ("qfThreadInfo")) == 0)
   {
@@ -164,11 +305,11 @@ bool Rsp::query(int socket_client, char* data, size_t len)
       ret += snprintf(&reply[ret], 256 - ret, "%u,", thread->get_thread_id());
     } 
 
-    return this->send(socket_client, reply, ret-1);
+    return this->send(client, reply, ret-1);
   }
   else if (strncmp ("qsThreadInfo", data, strlen ("qsThreadInfo")) == 0)
   {
-    return this->send_str(socket_client,  "l");
+    return this->send_str(client,  "l");
   }
   else if (strncmp ("qThreadExtraInfo", data, strlen ("qThreadExtraInfo")) == 0)
   {
@@ -177,7 +318,7 @@ bool Rsp::query(int socket_client, char* data, size_t len)
     unsigned int thread_id;
     if (sscanf(data, "qThreadExtraInfo,%d", &thread_id) != 1) {
       top->log->print(LOG_ERROR, "Could not parse qThreadExtraInfo packet\n");
-      return this->send_str(socket_client,  "");
+      return this->send_str(client,  "");
     }
     Target_core *thread = top->target->get_thread(thread_id);
     {
@@ -191,29 +332,29 @@ bool Rsp::query(int socket_client, char* data, size_t len)
         ret += snprintf(&reply[ret], 256 - ret, "%02X", str[i]);
     }
 
-    return this->send(socket_client, reply, ret);
+    return this->send(client, reply, ret);
   }
   else if (strncmp ("qAttached", data, strlen ("qAttached")) == 0)
   {
-    return this->send_str(socket_client,  "1");
+    return this->send_str(client,  "1");
   }
   else if (strncmp ("qC", data, strlen ("qC")) == 0)
   {
-    snprintf(reply, 64, "0.%u", this->top->target->get_thread(thread_sel)->get_thread_id());
-    return this->send_str(socket_client,  reply);
+    snprintf(reply, 64, "0.%u", this->top->target->get_thread(client->thread_sel)->get_thread_id());
+    return this->send_str(client,  reply);
   }
   else if (strncmp ("qSymbol", data, strlen ("qSymbol")) == 0)
   {
-    return this->send_str(socket_client,  "OK");
+    return this->send_str(client,  "OK");
   }
   else if (strncmp ("qOffsets", data, strlen ("qOffsets")) == 0)
   {
-    return this->send_str(socket_client,  "Text=0;Data=0;Bss=0");
+    return this->send_str(client,  "Text=0;Data=0;Bss=0");
   }
   else if (strncmp ("qT", data, strlen ("qT")) == 0)
   {
     // not supported, send empty packet
-    return this->send_str(socket_client,  "");
+    return this->send_str(client,  "");
   }
 
   top->log->print(LOG_ERROR, "Unknown query packet\n");
@@ -224,48 +365,19 @@ bool Rsp::query(int socket_client, char* data, size_t len)
 
 
 // internal helper functions
-bool Rsp::pc_read(int socket_client, unsigned int* pc)
+bool Rsp::pc_read(Rsp_client *client, unsigned int* pc)
 {
-  uint32_t npc;
-  uint32_t ppc;
-  uint32_t cause;
-  uint32_t hit;
-  Target_core *core;
-
-  core = this->top->target->get_thread(thread_sel);
-
-  core->read_ppc(&ppc);
-  core->read(DBG_NPC_REG, &npc);
-
-  core->read(DBG_HIT_REG, &hit);
-  core->read(DBG_CAUSE_REG, &cause);
-
-  if (hit & 0x1)
-    *pc = npc;
-  else if(cause & (1 << 31)) // interrupt
-    *pc = npc;
-  else if ((cause & 0x1f) == 3)  // breakpoint
-    *pc = ppc;
-  else if ((cause & 0x1f) == 2)
-    *pc = ppc;
-  else if ((cause & 0x1f) == 5)
-    *pc = ppc;
-  else
-    *pc = npc;
-
-  return true;
+  return this->top->target->get_thread(client->thread_sel)->pc_read(pc);
 }
 
 
 
 
-bool Rsp::mem_read(int socket_client, char* data, size_t len)
+bool Rsp::mem_read(Rsp_client *client, char* data, size_t len)
 {
-  unsigned char buffer[512];
-  char reply[512];
+  static const char hex[] = "0123456789abcdef";
   uint32_t addr;
   uint32_t length;
-  uint32_t rdata;
   int i;
 
   if (sscanf(data, "%x,%x", &addr, &length) != 2) {
@@ -273,19 +385,29 @@ bool Rsp::mem_read(int socket_client, char* data, size_t len)
     return false;
   }
 
-  top->cable->access(false, addr, length, (char *)buffer);
+  // The reply is in hex, thus twice as big
+  if (length > PACKET_MAX_LEN / 2)
+    length = PACKET_MAX_LEN / 2;
+
+  std::vector<unsigned char> buffer(length);
+  std::vector<char> reply(length * 2);
+
+  if (!top->mem_cache->read(addr, length, (char *)buffer.data()))
+    return this->send_str(client, "E01");
+
+  top->bkp->shadow(addr, length, (char *)buffer.data());
 
   for(i = 0; i < length; i++) {
-    rdata = buffer[i];
-    snprintf(&reply[i * 2], 3, "%02x", rdata);
+    reply[i * 2] = hex[buffer[i] >> 4];
+    reply[i * 2 + 1] = hex[buffer[i] & 0xf];
   }
 
-  return this->send(socket_client, reply, length*2);
+  return this->send(client, reply.data(), length*2);
 }
 
 
 
-bool Rsp::mem_write_ascii(int socket_client, char* data, size_t len)
+bool Rsp::mem_write_ascii(Rsp_client *client, char* data, size_t len)
 {
   uint32_t addr;
   int length;
@@ -295,7 +417,7 @@ bool Rsp::mem_write_ascii(int socket_client, char* data, size_t len)
   char* buffer;
   int buffer_len;
 
-  if (sscanf(data, "%x,%d:", &addr, &length) != 2) {
+  if (sscanf(data, "%x,%x:", &addr, &length) != 2) {
     top->log->print(LOG_ERROR, "Could not parse packet\n");
     return false;
   }
@@ -314,13 +436,15 @@ bool Rsp::mem_write_ascii(int socket_client, char* data, size_t len)
   len = len - i - 1;
 
   buffer_len = len/2;
+  if (buffer_len > length)
+    buffer_len = length;
   buffer = (char*)malloc(buffer_len);
   if (buffer == NULL) {
     top->log->print(LOG_ERROR, "Failed to allocate buffer\n");
     return false;
   }
 
-  for(j = 0; j < len/2; j++) {
+  for(j = 0; j < buffer_len; j++) {
     wdata = 0;
     for(i = 0; i < 2; i++) {
       char c = data[j * 2 + i];
@@ -332,20 +456,21 @@ bool Rsp::mem_write_ascii(int socket_client, char* data, size_t len)
       else if (c >= 'A' && c <= 'F')
         hex = c - 'A' + 10;
 
-      wdata |= hex << (4 * i);
+      wdata = (wdata << 4) | hex;
     }
 
     buffer[j] = wdata;
   }
 
-  top->cable->access(true, addr, buffer_len, buffer);
+  bool result = top->mem_cache->write(addr, buffer_len, buffer);
+  top->bkp->written(addr, buffer_len);
 
   free(buffer);
 
-  return this->send_str(socket_client,  "OK");
+  return this->send_str(client, result ? "OK" : "E01");
 }
 
-bool Rsp::mem_write(int socket_client, char* data, size_t len)
+bool Rsp::mem_write(Rsp_client *client, char* data, size_t len)
 {
   uint32_t addr;
   int length;
@@ -369,18 +494,32 @@ bool Rsp::mem_write(int socket_client, char* data, size_t len)
   if (i == len)
     return false;
 
-  // align to hex data
+  // align to binary data, which has already been unescaped when receiving
+  // the packet
   data = &data[i+1];
   len = len - i - 1;
 
-  top->cable->access(write, addr, len, data);
+  if (len < length) {
+    top->log->print(LOG_ERROR, "Binary write packet is too short (expected: %d, received: %d)\n", length, len);
+    return this->send_str(client, "E01");
+  }
+
+  // Zero-length writes are used by GDB to probe for X packet support
+  if (length == 0)
+    return this->send_str(client, "OK");
+
+  bool result = top->mem_cache->write(addr, length, data);
+  top->bkp->written(addr, length);
+
+  if (!result)
+    return this->send_str(client, "E01");
 
-  return this->send_str(socket_client,  "OK");
+  return this->send_str(client, "OK");
 }
 
 
 
-bool Rsp::reg_read(int socket_client, char* data, size_t len)
+bool Rsp::reg_read(Rsp_client *client, char* data, size_t len)
 {
   uint32_t addr;
   uint32_t rdata;
@@ -392,21 +531,21 @@ bool Rsp::reg_read(int socket_client, char* data, size_t len)
   }
 
   if (addr < 32)
-    this->top->target->get_thread(thread_sel)->gpr_read(addr, &rdata);
+    this->top->target->get_thread(client->thread_sel)->gpr_read(addr, &rdata);
   else if (addr == 0x20)
-    this->pc_read(socket_client, &rdata);
+    this->pc_read(client, &rdata);
   else
-    return this->send_str(socket_client,  "");
+    return this->send_str(client,  "");
 
   rdata = htonl(rdata);
   snprintf(data_str, 9, "%08x", rdata);
 
-  return this->send_str(socket_client,  data_str);
+  return this->send_str(client,  data_str);
 }
 
 
 
-bool Rsp::reg_write(int socket_client, char* data, size_t len)
+bool Rsp::reg_write(Rsp_client *client, char* data, size_t len)
 {
   uint32_t addr;
   uint32_t wdata;
@@ -420,20 +559,20 @@ bool Rsp::reg_write(int socket_client, char* data, size_t len)
 
   wdata = ntohl(wdata);
 
-  core = this->top->target->get_thread(thread_sel);
+  core = this->top->target->get_thread(client->thread_sel);
   if (addr < 32)
     core->gpr_write(addr, wdata);
   else if (addr == 32)
-    core->write(DBG_NPC_REG, wdata);
+    core->npc_write(wdata);
   else
-    return this->send_str(socket_client,  "E01");
+    return this->send_str(client,  "E01");
 
-  return this->send_str(socket_client,  "OK");
+  return this->send_str(client,  "OK");
 }
 
 
 
-bool Rsp::regs_send(int socket_client)
+bool Rsp::regs_send(Rsp_client *client)
 {
   uint32_t gpr[32];
   uint32_t npc;
@@ -441,64 +580,233 @@ bool Rsp::regs_send(int socket_client)
   char regs_str[512];
   int i;
 
-  this->top->target->get_thread(thread_sel)->gpr_read_all(gpr);
+  this->top->target->get_thread(client->thread_sel)->gpr_read_all(gpr);
 
   // now build the string to send back
   for(i = 0; i < 32; i++) {
     snprintf(&regs_str[i * 8], 9, "%08x", htonl(gpr[i]));
   }
 
-  this->pc_read(socket_client, &npc);
+  this->pc_read(client, &npc);
   snprintf(&regs_str[32 * 8 + 0 * 8], 9, "%08x", htonl(npc));
 
-  return this->send_str(socket_client,  regs_str);
+  return this->send_str(client,  regs_str);
 }
 
 
 
-bool Rsp::signal(int socket_client)
+// Returns the signal corresponding to the reason why a stopped core stopped,
+// or -1 if it could not be read
+int Rsp::get_signal(Target_core *core)
 {
   uint32_t cause;
   uint32_t hit;
+
+  // Get all the registers now in one go, GDB will anyway ask for them,
+  // and start fetching the memory it will read to show the new frame
+  if (core->snapshot())
+  {
+    uint32_t pc, sp;
+    if (core->pc_read(&pc) && core->gpr_read(2, &sp))
+      this->top->mem_cache->prefetch_stop(pc, sp);
+  }
+
+  if (!core->read(DBG_HIT_REG, &hit))
+    return -1;
+  if (!core->read(DBG_CAUSE_REG, &cause))
+    return -1;
+
+  if (hit & 0x1)
+    return TARGET_SIGNAL_TRAP;
+  else if(cause & (1 << 31))
+    return TARGET_SIGNAL_INT;
+  else if ((cause & 0x1f) == 3)
+    return TARGET_SIGNAL_TRAP;
+  else if ((cause & 0x1f) == 2)
+    return TARGET_SIGNAL_ILL;
+  else if ((cause & 0x1f) == 5)
+    return TARGET_SIGNAL_BUS;
+  else
+    return TARGET_SIGNAL_STOP;
+}
+
+
+
+// Formats in str the stop reply of a core, with the watchpoint which stopped
+// it if any, and returns its length
+int Rsp::stop_reply(Target_core *core, int signal, bool thread, char *str, int size)
+{
+  int len = thread ?
+    snprintf(str, size, "T%02xthread:%u;", signal, core->get_thread_id()) :
+    snprintf(str, size, "S%02x", signal);
+
+  if (signal != TARGET_SIGNAL_TRAP || !core->has_triggers())
+    return len;
+
+  // Single-steps and breakpoints are also reported as traps, they can be told
+  // from the hit register and the PC
+  uint32_t hit, ppc, pc, addr;
+  if (!core->read(DBG_HIT_REG, &hit) || (hit & 0x1))
+    return len;
+
+  core->read_ppc(&ppc);
+  if (this->top->bkp->at_addr(ppc) || !core->pc_read(&pc) || core->trigger_at(pc))
+    return len;
+
+  int type = core->trigger_watch_hit(&addr);
+  if (type == -1)
+    return len;
+
+  const char *kind = type == WP_WRITE ? "watch" : type == WP_READ ? "rwatch" : "awatch";
+
+  if (thread)
+    return len + snprintf(str + len, size - len, "%s:%x;", kind, addr);
+  else
+    return snprintf(str, size, "T%02x%s:%x;", signal, kind, addr);
+}
+
+
+
+// Returns 0 if the core stopped on a breakpoint whose conditions are all
+// false, and thus can be resumed without telling GDB, 1 if the stop must be
+// reported, or -1 if the core was halted by someone else
+int Rsp::bp_condition(Target_core *core)
+{
+  uint32_t hit, cause, ppc, npc, addr;
+
+  // Registers used by the conditions are then read from the snapshot
+  core->snapshot();
+
+  if (!core->read(DBG_HIT_REG, &hit) || !core->read(DBG_CAUSE_REG, &cause))
+    return 1;
+
+  if (hit & 0x1)
+    return 1;
+
+  if (cause & (1 << 31))
+    return -1;
+
+  core->read_ppc(&ppc);
+  if (!core->pc_read(&npc))
+    return 1;
+
+  // Software breakpoints stop after the ebreak, hardware ones before the
+  // instruction
+  if (this->top->bkp->at_addr(ppc))
+    addr = ppc;
+  else if (core->trigger_at(npc))
+    addr = npc;
+  else
+    return 1;
+
+  std::vector<std::vector<uint8_t>> *conditions = this->top->bkp->get_conditions(addr);
+  if (conditions == NULL)
+    return 1;
+
+  Agent_expr expr(this->top, core);
+
+  for (auto &condition: *conditions)
+  {
+    int64_t result;
+    if (!expr.eval(condition, &result) || result)
+      return 1;
+  }
+
+  top->log->debug("Breakpoint condition is false, resuming (addr: 0x%x)\n", addr);
+
+  return 0;
+}
+
+
+
+bool Rsp::signal(Rsp_client *client)
+{
   int signal;
-  char str[4];
+  char str[64];
   int len;
   Target_core *core;
 
-  core = this->top->target->get_thread(thread_sel);
+  if (client->non_stop)
+    return this->non_stop_status(client);
+
+  core = this->top->target->get_thread(client->thread_sel);
 
   //dbgif->write(DBG_IE_REG, 0xFFFF);
 
   // figure out why we are stopped
   if (core->is_stopped()) {
-    if (!core->read(DBG_HIT_REG, &hit))
-      return false;
-    if (!core->read(DBG_CAUSE_REG, &cause))
+    signal = this->get_signal(core);
+    if (signal == -1)
       return false;
-
-    if (hit & 0x1)
-      signal = TARGET_SIGNAL_TRAP;
-    else if(cause & (1 << 31))
-      signal = TARGET_SIGNAL_INT;
-    else if ((cause & 0x1f) == 3)
-      signal = TARGET_SIGNAL_TRAP;
-    else if ((cause & 0x1f) == 2)
-      signal = TARGET_SIGNAL_ILL;
-    else if ((cause & 0x1f) == 5)
-      signal = TARGET_SIGNAL_BUS;
-    else
-      signal = TARGET_SIGNAL_STOP;
   } else {
     signal = TARGET_SIGNAL_NONE;
   }
 
-  len = snprintf(str, 4, "S%02x", signal);
-  
-  return this->send(socket_client, str, len);
+  len = this->stop_reply(core, signal, false, str, 64);
+
+  return this->send(client, str, len);
+}
+
+
+
+bool Rsp::non_stop_status(Rsp_client *client)
+{
+  // Report all stopped threads, the first one now and the others through
+  // vStopped
+  client->stop_replies.clear();
+
+  for (auto &core: this->top->target->get_threads())
+  {
+    if (!client->running_cores.count(core) && core->is_stopped())
+    {
+      int signal = this->get_signal(core);
+      char str[64];
+      this->stop_reply(core, signal == -1 ? TARGET_SIGNAL_STOP : signal, true, str, 64);
+      client->stop_replies.push_back(str);
+    }
+  }
+
+  if (client->stop_replies.size() == 0)
+    return this->send_str(client, "OK");
+
+  return this->send_str(client, client->stop_replies.front().c_str());
+}
+
+
+
+bool Rsp::non_stop_resume(Rsp_client *client, Target_core *core, bool step)
+{
+  if (client->running_cores.count(core))
+    return true;
+
+  // Only this core is resumed, without going through the cluster global
+  // resume, and the memory cache must not be used while it is running
+  this->top->mem_cache->invalidate();
+
+  core->prepare_resume(step);
+  core->resume();
+
+  client->running_cores.insert(core);
+
+  return true;
+}
+
+
+
+void Rsp::update_cache_bypass()
+{
+  bool bypass = false;
+  for (auto &x: this->clients)
+  {
+    if (x.second->running_cores.size())
+      bypass = true;
+  }
+
+  this->top->mem_cache->set_bypass(bypass);
 }
 
 
-bool Rsp::cont(int socket_client, char* data, size_t len)
+bool Rsp::cont(Rsp_client *client, char* data, size_t len)
 {
   uint32_t sig;
   uint32_t addr;
@@ -517,7 +825,7 @@ bool Rsp::cont(int socket_client, char* data, size_t len)
   }
 
   if (npc_found) {
-    core = this->top->target->get_thread(thread_sel);
+    core = this->top->target->get_thread(client->thread_sel);
     // only when we have received an address
     core->read(DBG_NPC_REG, &npc);
 
@@ -525,30 +833,30 @@ bool Rsp::cont(int socket_client, char* data, size_t len)
       core->write(DBG_NPC_REG, addr);
   }
 
-  thread_sel = m_thread_init;
+  client->thread_sel = m_thread_init;
 
-  return this->resume(socket_client, false);
+  return this->resume(client, false);
 }
 
 
 
-bool Rsp::resume(int socket_client, bool step)
+bool Rsp::resume(Rsp_client *client, bool step)
 {
   this->top->target->resume(step);
-  return this->wait(socket_client);
+  return this->wait(client);
 }
 
 
 
-bool Rsp::resume(int socket_client, int tid, bool step)
+bool Rsp::resume(Rsp_client *client, int tid, bool step)
 {
   this->top->target->resume(step, tid);
-  return this->wait(socket_client);
+  return this->wait(client);
 }
 
 
 
-bool Rsp::step(int socket_client, char* data, size_t len)
+bool Rsp::step(Rsp_client *client, char* data, size_t len)
 {
   uint32_t addr;
   uint32_t npc;
@@ -566,7 +874,7 @@ bool Rsp::step(int socket_client, char* data, size_t len)
   }
 
   if (sscanf(data, "%x", &addr) == 1) {
-    core = this->top->target->get_thread(thread_sel);
+    core = this->top->target->get_thread(client->thread_sel);
     // only when we have received an address
     core->read(DBG_NPC_REG, &npc);
 
@@ -574,68 +882,190 @@ bool Rsp::step(int socket_client, char* data, size_t len)
       core->write(DBG_NPC_REG, addr);
   }
 
-  thread_sel = m_thread_init;
+  client->thread_sel = m_thread_init;
 
-  return this->resume(socket_client, true);
+  return this->resume(client, true);
 }
 
 
 
-bool Rsp::wait(int socket_client, Target_core *core)
+bool Rsp::wait(Rsp_client *client, Target_core *core)
 {
-  int ret;
-  char pkt;
+  // The stop reply is sent from the event loop once the target is found
+  // stopped, so that other clients can still be served meanwhile.
+  // Short runs (steps, breakpoints close by) are detected quickly, while
+  // long runs slowly back off to limit the cable usage
+  client->running = true;
+  client->wait_core = core;
 
-  fd_set rfds;
-  struct timeval tv;
+  this->poll_interval = poll_min;
+  this->poll_next = std::chrono::steady_clock::now();
+
+  return true;
+}
 
-  while(1) {
 
-    // Check if a cluster power state has changed
-    this->top->target->update_power();
 
-    //First check if one core has stopped
-    if (core) {
-      if (core->is_stopped()) {
-        this->top->target->halt();
-        return this->signal(socket_client);
+void Rsp::check_stop()
+{
+  auto now = std::chrono::steady_clock::now();
+  if (now < this->poll_next)
+    return;
+
+  // Check if a cluster power state has changed and if one core has stopped
+  this->top->target->poll();
+
+  for (auto &x: this->clients)
+  {
+    Rsp_client *client = x.second;
+
+    for (auto it = client->running_cores.begin(); it != client->running_cores.end();)
+    {
+      Target_core *core = *it;
+      if (!core->get_stopped()) {
+        it++;
+        continue;
+      }
+
+      if (!client->stop_requested.count(core) && this->range_continue(client, core)) {
+        it++;
+        continue;
+      }
+
+      if (!client->stop_requested.count(core) && this->bp_condition(core) == 0) {
+        this->top->mem_cache->invalidate();
+        core->prepare_resume(false);
+        core->resume();
+        it++;
+        continue;
       }
+
+      it = client->running_cores.erase(it);
+
+      // Threads stopped on GDB request are reported with signal 0
+      int signal = client->stop_requested.erase(core) ? TARGET_SIGNAL_NONE : this->get_signal(core);
+      char str[64];
+      this->stop_reply(core, signal == -1 ? TARGET_SIGNAL_STOP : signal, true, str, 64);
+
+      // Only one notification can be pending, the next ones are sent when
+      // GDB acknowledges the previous one with vStopped
+      client->stop_replies.push_back(str);
+      if (client->stop_replies.size() == 1)
+      {
+        std::string notif = std::string("Stop:") + str;
+        this->send(client, notif.c_str(), notif.size(), true);
+      }
+    }
+
+    if (!client->running)
+      continue;
+
+    bool stopped = false;
+    if (client->wait_core) {
+      stopped = client->wait_core->get_stopped();
     } else {
       for (auto &core: this->top->target->get_threads()) {
-        if (core->is_stopped()) {
-          this->top->target->halt();
-          return this->signal(socket_client);
+        if (core->get_stopped()) {
+          stopped = true;
+          break;
         }
       }
     }
 
-    // Otherwise wait for a stop request from gdb side for a while
-
-    FD_ZERO(&rfds);
-    FD_SET(socket_client, &rfds);
-
-    tv.tv_sec = 0;
-    tv.tv_usec = 100 * 1000;
+    if (stopped && client->range_core && client->range_core->get_stopped() && this->range_continue(client, client->range_core)) {
+      stopped = false;
+    }
 
-    if (select(socket_client+1, &rfds, NULL, NULL, &tv)) {
-      ret = recv(socket_client, &pkt, 1, 0);
-      if (ret == 1 && pkt == 0x3) {
-        if (core) {
-          core->halt();
-          return this->signal(socket_client);
-        } else {
-          top->target->halt();
+    // Breakpoints with false conditions are resumed at once, unless another
+    // core has a reason to stop
+    if (stopped) {
+      bool resume = false;
+      for (auto &core: this->top->target->get_threads()) {
+        if (!core->get_stopped())
+          continue;
+        int condition = this->bp_condition(core);
+        if (condition == 1) {
+          resume = false;
+          break;
         }
+        if (condition == 0)
+          resume = true;
+      }
+
+      if (resume) {
+        if (client->wait_core)
+          this->top->target->resume(false, client->wait_core->get_thread_id());
+        else
+          this->top->target->resume(false);
+        stopped = false;
       }
     }
+
+    if (stopped) {
+      client->running = false;
+      this->top->target->halt();
+      this->signal(client);
+    }
+  }
+
+  this->update_cache_bypass();
+
+  this->poll_next = now + std::chrono::microseconds(this->poll_interval);
+
+  this->poll_interval *= 2;
+  if (this->poll_interval > poll_max)
+    this->poll_interval = poll_max;
+}
+
+
+
+// Steps the core further if it is range stepping and did not leave the range
+// yet. Returns true if the core was resumed.
+bool Rsp::range_continue(Rsp_client *client, Target_core *core)
+{
+  if (client->range_core != core)
+    return false;
+
+  // The bridge keeps stepping by batches, so that other clients and
+  // interrupts are still handled by the event loop
+  if (core->range_step(client->range_start, client->range_end, RANGE_STEP_BATCH)) {
+    client->range_core = NULL;
+    return false;
+  }
+
+  core->resume();
+
+  this->poll_interval = poll_min;
+
+  return true;
+}
+
+
+
+bool Rsp::interrupt(Rsp_client *client)
+{
+  client->range_core = NULL;
+
+  if (!client->running)
+    return this->signal(client);
+
+  if (client->wait_core) {
+    client->running = false;
+    client->wait_core->halt();
+    return this->signal(client);
   }
 
+  // The stop reply is sent when the halt is detected
+  top->target->halt();
+  this->poll_interval = poll_min;
+  this->poll_next = std::chrono::steady_clock::now();
+
   return true;
 }
 
 
 
-bool Rsp::multithread(int socket_client, char* data, size_t len)
+bool Rsp::multithread(Rsp_client *client, char* data, size_t len)
 {
   int thread_id;
 
@@ -646,15 +1076,15 @@ bool Rsp::multithread(int socket_client, char* data, size_t len)
         return false;
 
       if (thread_id == -1) // affects all threads
-        return this->send_str(socket_client,  "OK");
+        return this->send_str(client,  "OK");
 
       // we got the thread id, now let's look for this thread in our list
       if (this->top->target->get_thread(thread_id) != NULL) {
-        thread_sel = thread_id;
-        return this->send_str(socket_client,  "OK");
+        client->thread_sel = thread_id;
+        return this->send_str(client,  "OK");
       }
 
-      return this->send_str(socket_client,  "E01");
+      return this->send_str(client,  "E01");
   }
 
   return false;
@@ -662,63 +1092,93 @@ bool Rsp::multithread(int socket_client, char* data, size_t len)
 
 
 
-bool Rsp::decode(int socket_client, char* data, size_t len)
+bool Rsp::decode(Rsp_client *client, char* data, size_t len)
 {
   if (data[0] == 0x03) {
     top->log->print(LOG_DEBUG, "Received break\n");
-    return this->signal(socket_client);
+    return this->interrupt(client);
   }
 
   switch (data[0]) {
   case 'q':
-    return this->query(socket_client, &data[0], len);
+    return this->query(client, &data[0], len);
+
+  case 'Q':
+    if (strncmp ("QStartNoAckMode", data, strlen ("QStartNoAckMode")) == 0)
+    {
+      // The OK reply is still acknowledged, the mode only starts after it
+      if (!this->send_str(client, "OK"))
+        return false;
+      client->no_ack = true;
+      return true;
+    }
+    else if (strncmp ("QNonStop:", data, strlen ("QNonStop:")) == 0)
+    {
+      bool non_stop = data[9] == '1';
+
+      // The cross-trigger setting is global to the target, the mode can not
+      // be different from the one of the other clients
+      for (auto &x: this->clients)
+      {
+        if (x.second != client && x.second->non_stop != non_stop)
+        {
+          top->log->warning("Refusing mode change conflicting with other clients (non_stop: %d)\n", non_stop);
+          return this->send_str(client, "E01");
+        }
+      }
+
+      client->non_stop = non_stop;
+      this->top->target->set_non_stop(client->non_stop);
+      return this->send_str(client, "OK");
+    }
+    return this->send_str(client, "");
 
   case 'g':
-    return this->regs_send(socket_client);
+    return this->regs_send(client);
 
   case 'p':
-    return this->reg_read(socket_client, &data[1], len-1);
+    return this->reg_read(client, &data[1], len-1);
 
   case 'P':
-    return this->reg_write(socket_client, &data[1], len-1);
+    return this->reg_write(client, &data[1], len-1);
 
   case 'c':
   case 'C':
-    return this->cont(socket_client, &data[0], len);
+    return this->cont(client, &data[0], len);
 
   case 's':
   case 'S':
-    return this->step(socket_client, &data[0], len);
+    return this->step(client, &data[0], len);
 
   case 'H':
-    return this->multithread(socket_client, &data[1], len-1);
+    return this->multithread(client, &data[1], len-1);
 
   case 'm':
-    return this->mem_read(socket_client, &data[1], len-1);
+    return this->mem_read(client, &data[1], len-1);
 
   case '?':
-    return this->signal(socket_client);
+    return this->signal(client);
 
   case 'v':
-    return this->v_packet(socket_client, &data[0], len);
+    return this->v_packet(client, &data[0], len);
 
   case 'M':
-    return this->mem_write_ascii(socket_client, &data[1], len-1);
+    return this->mem_write_ascii(client, &data[1], len-1);
 
   case 'X':
-    return this->mem_write(socket_client, &data[1], len-1);
+    return this->mem_write(client, &data[1], len-1);
 
   case 'z':
-    return this->bp_remove(socket_client, &data[0], len);
+    return this->bp_remove(client, &data[0], len);
 
   case 'Z':
-    return this->bp_insert(socket_client, &data[0], len);
+    return this->bp_insert(client, &data[0], len);
 
   case 'T':
-    return this->send_str(socket_client,  "OK"); // threads are always alive
+    return this->send_str(client,  "OK"); // threads are always alive
 
   case 'D':
-    this->send_str(socket_client,  "OK");
+    this->send_str(client,  "OK");
     return false;
 
   default:
@@ -731,127 +1191,115 @@ bool Rsp::decode(int socket_client, char* data, size_t len)
 
 
 
-bool
-Rsp::get_packet(int socket_client, char* pkt, size_t* p_pkt_len) {
-  char c;
-  char check_chars[2];
-  char buffer[PACKET_MAX_LEN];
-  int  buffer_len = 0;
-  int  pkt_len;
-  bool escaped = false;
-  int ret;
+// Extracts the next packet from what has been received from the client.
+// Returns 1 if a packet was found, 0 if more data is needed and -1 in case
+// of error.
+int
+Rsp::get_packet(Rsp_client *client, std::vector<char> &pkt, size_t* p_pkt_len) {
+  std::vector<char> &in = client->in_buffer;
   // packets follow the format: $packet-data#checksum
   // checksum is two-digit
 
-  // poison packet
-  memset(pkt, 0, PACKET_MAX_LEN);
-  pkt_len = 0;
+  while (1) {
+    // first look for start bit
+    while (client->in_pos < in.size() && in[client->in_pos] != '$') {
+      char c = in[client->in_pos++];
+
+      // special case for 0x03 (asynchronous break)
+      if (c == 0x03) {
+        pkt.assign(1, c);
+        pkt.push_back(0);
+        *p_pkt_len = 1;
+        return 1;
+      }
 
-  // first look for start bit
-  do {
-    ret = recv(socket_client, &c, 1, 0);
+      // GDB could not decode our last packet, send it again
+      if (c == '-' && !client->no_ack && client->last_packet.size()) {
+        client->put(client->last_packet.data(), client->last_packet.size());
+        if (!client->flush())
+          return -1;
+      }
 
-    if((ret == -1 && errno != EWOULDBLOCK) || (ret == 0)) {
-      top->log->print(LOG_ERROR, "RSP: Error receiving\n");
-      return false;
+      // Anything else, including '+' acks, is skipped
     }
 
-    if(ret == -1 && errno == EWOULDBLOCK) {
-      // no data available
-      continue;
-    }
+    if (client->in_pos == in.size())
+      return 0;
 
-    // special case for 0x03 (asynchronous break)
-    if (c == 0x03) {
-      pkt[0]  = c;
-      *p_pkt_len = 1;
-      return true;
-    }
-  } while(c != '$');
+    // now store data as long as we don't see #
+    unsigned int checksum = 0;
+    bool escaped = false;
+    size_t pos = client->in_pos + 1;
 
-  buffer[0] = c;
+    pkt.clear();
 
-  // now store data as long as we don't see #
-  do {
-    if (buffer_len >= PACKET_MAX_LEN || pkt_len >= PACKET_MAX_LEN) {
-      top->log->print(LOG_ERROR, "RSP: Too many characters received\n");
-      return false;
-    }
+    for (; pos < in.size(); pos++) {
+      char c = in[pos];
 
-    ret = recv(socket_client, &c, 1, 0);
+      if (c == '#' && !escaped)
+        break;
 
-    if((ret == -1 && errno != EWOULDBLOCK) || (ret == 0)) {
-      top->log->print(LOG_ERROR, "RSP: Error receiving\n");
-      return false;
-    }
+      checksum += (unsigned char)c;
 
-    if(ret == -1 && errno == EWOULDBLOCK) {
-      // no data available
-      continue;
-    }
+      // check for 0x7d = '}'
+      if (c == 0x7d && !escaped) {
+        escaped = true;
+        continue;
+      }
 
-    buffer[buffer_len++] = c;
+      if (escaped)
+        pkt.push_back(c ^ 0x20);
+      else
+        pkt.push_back(c);
 
-    // check for 0x7d = '}'
-    if (c == 0x7d) {
-      escaped = true;
-      continue;
+      escaped = false;
     }
 
-    if (escaped)
-      pkt[pkt_len++] = c ^ 0x20;
-    else
-      pkt[pkt_len++] = c;
-
-    escaped = false;
-  } while(c != '#');
-
-  buffer_len--;
-  pkt_len--;
-
-  // checksum, 2 bytes
-  ret = recv(socket_client, &check_chars[0], 1, 0);
-  if((ret == -1 && errno != EWOULDBLOCK) || (ret == 0)) {
-    top->log->print(LOG_ERROR, "RSP: Error receiving\n");
-    return false;
-  }
+    if (pkt.size() > PACKET_MAX_LEN) {
+      top->log->print(LOG_ERROR, "RSP: Too many characters received\n");
+      return -1;
+    }
 
-  ret = recv(socket_client, &check_chars[1], 1, 0);
-  if((ret == -1 && errno != EWOULDBLOCK) || (ret == 0)) {
-    top->log->print(LOG_ERROR, "RSP: Error receiving\n");
-    return false;
-  }
+    // checksum, 2 bytes
+    if (pos + 2 >= in.size())
+      return 0;
+
+    char *check_chars = &in[pos + 1];
+    client->in_pos = pos + 3;
+
+    // In no-ack mode the checksum is not relevant anymore
+    if (!client->no_ack) {
+      // check the checksum
+      checksum = checksum % 256;
+      char checksum_str[3];
+      snprintf(checksum_str, 3, "%02x", checksum);
+
+      if (check_chars[0] != checksum_str[0] || check_chars[1] != checksum_str[1]) {
+        top->log->print(LOG_ERROR, "RSP: Checksum failed; received %.*s; checksum should be %02x\n", pkt.size(), pkt.data(), checksum);
+        client->put("-", 1);
+        if (!client->flush())
+          return -1;
+        continue;
+      }
 
-  // check the checksum
-  unsigned int checksum = 0;
-  for(int i = 0; i < buffer_len; i++) {
-    checksum += buffer[i];
-  }
+      // now send ACK
+      client->put("+", 1);
+      if (!client->flush()) {
+        top->log->print(LOG_ERROR, "RSP: Sending ACK failed\n");
+        return -1;
+      }
+    }
 
-  checksum = checksum % 256;
-  char checksum_str[3];
-  snprintf(checksum_str, 3, "%02x", checksum);
+    *p_pkt_len = pkt.size();
 
-  if (check_chars[0] != checksum_str[0] || check_chars[1] != checksum_str[1]) {
-    top->log->print(LOG_ERROR, "RSP: Checksum failed; received %.*s; checksum should be %02x\n", pkt_len, pkt, checksum);
-    return false;
-  }
+    // NULL terminate the string
+    pkt.push_back(0);
 
-  // now send ACK
-  char ack = '+';
-  if (::send(socket_client, &ack, 1, 0) != 1) {
-    top->log->print(LOG_ERROR, "RSP: Sending ACK failed\n");
-    return false;
+    return 1;
   }
-
-  // NULL terminate the string
-  pkt[pkt_len] = '\0';
-  *p_pkt_len = pkt_len;
-
-  return true;
 }
 
-bool Rsp::send(int socket_client, const char* data, size_t len)
+bool Rsp::send(Rsp_client *client, const char* data, size_t len, bool notification)
 {
   int ret;
   int i;
@@ -859,20 +1307,21 @@ bool Rsp::send(int socket_client, const char* data, size_t len)
   char* raw = (char*)malloc(len * 2 + 4);
   unsigned int checksum = 0;
 
-  raw[raw_len++] = '$';
+  // Notifications are not acknowledged
+  raw[raw_len++] = notification ? '%' : '$';
 
   for (i = 0; i < len; i++) {
     char c = data[i];
 
     // check if escaping needed
-    if (c == '#' || c == '%' || c == '}' || c == '*') {
+    if (c == '#' || c == '$' || c == '%' || c == '}' || c == '*') {
       raw[raw_len++] = '}';
-      raw[raw_len++] = c;
+      raw[raw_len++] = c ^ 0x20;
       checksum += '}';
-      checksum += c;
+      checksum += (unsigned char)(c ^ 0x20);
     } else {
       raw[raw_len++] = c;
-      checksum += c;
+      checksum += (unsigned char)c;
     }
   }
 
@@ -885,83 +1334,157 @@ bool Rsp::send(int socket_client, const char* data, size_t len)
   raw[raw_len++] = checksum_str[0];
   raw[raw_len++] = checksum_str[1];
 
-  char ack;
-  do {
-    top->log->print(LOG_DEBUG, "Sending %.*s\n", raw_len, raw);
-
-    if (::send(socket_client, raw, raw_len, 0) != raw_len) {
-      free(raw);
-      top->log->print(LOG_ERROR, "Unable to send data to client\n");
-      return false;
-    }
-
-    ret = recv(socket_client, &ack, 1, 0);
-    if((ret == -1 && errno != EWOULDBLOCK) || (ret == 0)) {
-      free(raw);
-      top->log->print(LOG_ERROR, "RSP: Error receiving\n");
-      return false;
-    }
+  top->log->print(LOG_DEBUG, "Sending %.*s\n", raw_len, raw);
 
-    if(ret == -1 && errno == EWOULDBLOCK) {
-      // no data available
-      continue;
-    }
+  // The ack is not waited for here, it is handled when parsing the next
+  // incoming packet, which resends this one in case of NACK
+  if (!client->no_ack && !notification)
+    client->last_packet.assign(raw, raw + raw_len);
 
-  } while (ack != '+');
+  client->put(raw, raw_len);
+  bool result = client->flush();
 
   free(raw);
-  return true;
+  return result;
 }
 
-bool Rsp::send_str(int socket_client, const char* data)
+bool Rsp::send_str(Rsp_client *client, const char* data)
 {
-  return this->send(socket_client, data, strlen(data));
+  return this->send(client, data, strlen(data));
 }
 
-void Rsp::client_routine(int socket_client)
+void Rsp::client_accept()
 {
-  while(1)
+  int socket_client;
+
+  if((socket_client = accept(socket_in, NULL, NULL)) == -1)
   {
-    char pkt[PACKET_MAX_LEN];
-    size_t len;
+    if(errno != EAGAIN && errno != EINTR)
+      top->log->print(LOG_ERROR, "Unable to accept connection: %s\n", strerror(errno));
+    return;
+  }
 
-    fd_set rfds;
-    struct timeval tv;
+  top->log->print(LOG_INFO, "RSP: Client connected!\n");
 
-    while (this->get_packet(socket_client, pkt, &len)) {
-      top->log->print(LOG_DEBUG, "Received $%.*s\n", len, pkt);
-      if (!this->decode(socket_client, pkt, len)) {
-        return;
-      }
+  Rsp_client *client = new Rsp_client(top->log, socket_client, m_thread_init);
+
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = socket_client;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_client, &event) == -1)
+  {
+    top->log->print(LOG_ERROR, "Unable to register client socket: %s\n", strerror(errno));
+    delete client;
+    return;
+  }
+
+  this->clients[socket_client] = client;
+}
+
+
+
+void Rsp::client_close(Rsp_client *client)
+{
+  top->log->print(LOG_INFO, "RSP: Client disconnected\n");
+
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->get_socket(), NULL);
+  this->clients.erase(client->get_socket());
+  delete client;
+}
+
+
+
+bool Rsp::client_handle(Rsp_client *client)
+{
+  std::vector<char> pkt;
+  size_t len;
+  int ret;
+
+  if (!client->receive())
+    return false;
+
+  while ((ret = this->get_packet(client, pkt, &len)) == 1) {
+    top->log->print(LOG_DEBUG, "Received $%.*s\n", len, pkt.data());
+    if (!this->decode(client, pkt.data(), len)) {
+      return false;
     }
   }
+
+  return ret == 0;
 }
 
-void Rsp::listener_routine()
+
+
+void Rsp::loop_routine()
 {
-  while(1)
+  struct epoll_event events[16];
+
+  while(!this->loop_end)
   {
-    int socket_client;
+    int timeout = -1;
 
-    if((socket_client = accept(socket_in, NULL, NULL)) == -1)
+    // While some clients are waiting for a stop, the target must be polled
+    for (auto &x: this->clients)
     {
-      if(errno == EAGAIN)
+      if (x.second->is_waiting())
+      {
+        auto delay = this->poll_next - std::chrono::steady_clock::now();
+        timeout = std::chrono::duration_cast<std::chrono::milliseconds>(delay).count();
+        if (timeout < 0) timeout = 0;
+        break;
+      }
+    }
+
+    int nb_events = epoll_wait(epoll_fd, events, 16, timeout);
+    if (nb_events == -1)
+    {
+      if (errno == EINTR)
         continue;
 
-      top->log->print(LOG_ERROR, "Unable to accept connection: %s\n", strerror(errno));
-      return;
+      top->log->print(LOG_ERROR, "Unable to wait for RSP events: %s\n", strerror(errno));
+      break;
     }
 
-    top->log->print(LOG_INFO, "RSP: Client connected!\n");
+    for (int i=0; i<nb_events; i++)
+    {
+      int fd = events[i].data.fd;
 
-    std::thread *thread = new std::thread(&Rsp::client_routine, this, socket_client);
+      if (fd == socket_in)
+      {
+        this->client_accept();
+      }
+      else if (fd != wake_pipe[0])
+      {
+        auto it = this->clients.find(fd);
+        if (it != this->clients.end() && !this->client_handle(it->second))
+          this->client_close(it->second);
+      }
+    }
 
+    if (timeout != -1)
+      this->check_stop();
+  }
+
+  while (this->clients.size())
+  {
+    this->client_close(this->clients.begin()->second);
   }
 }
 
 void Rsp::close(int kill)
 {
-  listener_thread->join();
+  char c = 0;
+  this->loop_end = true;
+  if (::write(wake_pipe[1], &c, 1) != 1)
+    top->log->warning("Unable to wake-up RSP server\n");
+
+  loop_thread->join();
+  delete loop_thread;
+
+  ::close(epoll_fd);
+  ::close(wake_pipe[0]);
+  ::close(wake_pipe[1]);
+  ::close(socket_in);
 }
 
 bool
@@ -991,14 +1514,27 @@ Rsp::open() {
     return false;
   }
 
-  if(listen(socket_in, 1) == -1) {
+  if(listen(socket_in, 4) == -1) {
     top->log->print(LOG_ERROR, "Unable to listen: %s\n", strerror(errno));
     return false;
   }
 
+  epoll_fd = epoll_create1(0);
+  if (epoll_fd == -1 || pipe(wake_pipe) == -1) {
+    top->log->print(LOG_ERROR, "Unable to create RSP event loop: %s\n", strerror(errno));
+    return false;
+  }
+
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = socket_in;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_in, &event);
+  event.data.fd = wake_pipe[0];
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_pipe[0], &event);
+
   this->top->target->halt();
 
-  listener_thread = new std::thread(&Rsp::listener_routine, this);
+  loop_thread = new std::thread(&Rsp::loop_routine, this);
 
   top->log->print(LOG_INFO, "RSP server opened on port %d\n", socket_port);
 
@@ -1007,32 +1543,76 @@ Rsp::open() {
 
 
 
-bool Rsp::bp_insert(int socket_client, char* data, size_t len)
+bool Rsp::bp_insert(Rsp_client *client, char* data, size_t len)
 {
   enum mp_type type;
   uint32_t addr;
   uint32_t data_bp;
   int bp_len;
 
-  if (3 != sscanf(data, "Z%1d,%x,%1d", (int *)&type, &addr, &bp_len)) {
+  bool result;
+
+  if (3 != sscanf(data, "Z%1d,%x,%x", (int *)&type, &addr, &bp_len)) {
     top->log->print(LOG_ERROR, "Could not get three arguments\n");
     return false;
   }
 
-  if (type != BP_MEMORY) {
-    top->log->print(LOG_ERROR, "ERROR: Not a memory bp\n");
-    this->send_str(socket_client,  "");
-    return false;
+  // Conditions come after the kind as ";X<len>,<bytecode in hex>", other
+  // parameters like target-side commands are ignored
+  std::vector<std::vector<uint8_t>> conditions;
+  char *cond = strchr(data, ';');
+
+  while (cond != NULL && cond[1] == 'X')
+  {
+    char *end;
+    int cond_len = strtol(cond + 2, &end, 16);
+    if (*end != ',' || strlen(end + 1) < cond_len * 2) {
+      top->log->print(LOG_ERROR, "Could not parse breakpoint condition\n");
+      return this->send_str(client, "E01");
+    }
+
+    std::vector<uint8_t> code(cond_len);
+    for (int i=0; i<cond_len; i++) {
+      sscanf(end + 1 + i*2, "%2hhx", &code[i]);
+    }
+    conditions.push_back(code);
+
+    cond = end + 1 + cond_len*2;
+    if (*cond != ';')
+      cond = NULL;
+  }
+
+  if (type == BP_MEMORY || type == BP_HARDWARE)
+    top->bkp->set_conditions(addr, conditions);
+
+  if (type == BP_MEMORY) {
+    // Memory which cannot be patched, like ROM or XIP flash, needs a trigger
+    result = top->bkp->insert(addr) || top->bkp->insert_hw(BP_HARDWARE, addr);
+  } else if (type == BP_HARDWARE) {
+    // Use a software breakpoint when the triggers are all used
+    result = top->bkp->insert_hw(type, addr) || top->bkp->insert(addr);
+  } else if (type <= WP_ACCESS) {
+    // Without triggers, let GDB fall back to software watchpoints
+    if (!top->bkp->has_hw())
+      return this->send_str(client,  "");
+    // A trigger only watches one word
+    if (bp_len <= 0 || (addr & 3) + bp_len > 4)
+      return this->send_str(client, "E01");
+    result = top->bkp->insert_hw(type, addr);
+  } else {
+    return this->send_str(client,  "");
   }
 
-  top->bkp->insert(addr);
+  // Running cores would not see the breakpoint until the next resume
+  if (client->non_stop)
+    result = top->bkp->commit() && result;
 
-  return this->send_str(socket_client,  "OK");
+  return this->send_str(client, result ? "OK" : "E01");
 }
 
 
 
-bool Rsp::bp_remove(int socket_client, char* data, size_t len)
+bool Rsp::bp_remove(Rsp_client *client, char* data, size_t len)
 {
   enum mp_type type;
   uint32_t addr;
@@ -1040,19 +1620,31 @@ bool Rsp::bp_remove(int socket_client, char* data, size_t len)
   int bp_len;
   Target_core *core;
 
-  core = this->top->target->get_thread(thread_sel);
+  core = this->top->target->get_thread(client->thread_sel);
 
-  if (3 != sscanf(data, "z%1d,%x,%1d", (int *)&type, &addr, &bp_len)) {
+  if (3 != sscanf(data, "z%1d,%x,%x", (int *)&type, &addr, &bp_len)) {
     top->log->print(LOG_ERROR, "Could not get three arguments\n");
     return false;
   }
 
-  if (type != BP_MEMORY) {
-    top->log->print(LOG_ERROR, "Not a memory bp\n");
-    return false;
+  if (type > WP_ACCESS)
+    return this->send_str(client,  "");
+
+  if (type != BP_MEMORY && type != BP_HARDWARE) {
+    return this->send_str(client, top->bkp->remove_hw(type, addr) ? "OK" : "E01");
+  }
+
+  std::vector<std::vector<uint8_t>> conditions;
+  top->bkp->set_conditions(addr, conditions);
+
+  // Breakpoints may have been inserted with the other method
+  if (!top->bkp->remove(addr)) {
+    top->bkp->remove_hw(BP_HARDWARE, addr);
+    return this->send_str(client,  "OK");
   }
 
-  top->bkp->remove(addr);
+  if (client->non_stop)
+    top->bkp->commit();
 
   // check if we are currently on this bp that is removed
   core->read_ppc(&ppc);
@@ -1061,7 +1653,7 @@ bool Rsp::bp_remove(int socket_client, char* data, size_t len)
     core->write(DBG_NPC_REG, ppc); // re-execute this instruction
   }
 
-  return this->send_str(socket_client,  "OK");
+  return this->send_str(client,  "OK");
 }
 
 
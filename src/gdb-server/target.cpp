@@ -58,6 +58,8 @@ class Target_cluster_power
 {
 public:
   virtual bool is_on() { return true; }
+  virtual void poll_prepare(std::vector<Cable_io_elem> &list) {}
+  virtual bool poll_is_on() { return true; }
 };
 
 
@@ -67,11 +69,14 @@ class Target_cluster_power_bypass : public Target_cluster_power
 public:
   Target_cluster_power_bypass(Gdb_server *top, uint32_t reg_addr, int bit);
   bool is_on();
+  void poll_prepare(std::vector<Cable_io_elem> &list);
+  bool poll_is_on();
 
 private:
   Gdb_server *top;
   uint32_t reg_addr;
   int bit;
+  uint32_t poll_value;
 };
 
 
@@ -81,6 +86,7 @@ class Target_cluster_ctrl
 {
 public:
   virtual bool init() {}
+  virtual void set_all_stop(bool all_stop) {}
 };
 
 
@@ -90,10 +96,12 @@ class Target_cluster_ctrl_xtrigger : public Target_cluster_ctrl
 public:
   Target_cluster_ctrl_xtrigger(Gdb_server *top, uint32_t cluster_ctrl_addr);
   bool init();
+  void set_all_stop(bool all_stop);
 
 private:
   Gdb_server *top;
-  uint32_t cluster_ctrl_addr;  
+  uint32_t cluster_ctrl_addr;
+  bool all_stop = true;
 };
 
 
@@ -139,13 +147,21 @@ Target_cluster_ctrl_xtrigger::Target_cluster_ctrl_xtrigger(Gdb_server *top, uint
 bool Target_cluster_ctrl_xtrigger::init()
 {
   uint32_t info;
-  // set all-stop mode, so that all cores go to debug when one enters debug mode
-  info = 0xFFFFFFFF;
+  // set all-stop mode, so that all cores go to debug when one enters debug mode,
+  // unless GDB is in non-stop mode
+  info = this->all_stop ? 0xFFFFFFFF : 0;
   top->cable->access(true, cluster_ctrl_addr + 0x000038, 4, (char*)&info);
 }
 
 
 
+void Target_cluster_ctrl_xtrigger::set_all_stop(bool all_stop)
+{
+  this->all_stop = all_stop;
+}
+
+
+
 Target_cluster_power_bypass::Target_cluster_power_bypass(Gdb_server *top, uint32_t reg_addr, int bit)
 : top(top), reg_addr(reg_addr), bit(bit)
 {
@@ -158,6 +174,16 @@ bool Target_cluster_power_bypass::is_on()
   return (info >> bit) & 1;
 }
 
+void Target_cluster_power_bypass::poll_prepare(std::vector<Cable_io_elem> &list)
+{
+  list.push_back(Cable_io_elem(false, reg_addr, 4, (char*)&poll_value));
+}
+
+bool Target_cluster_power_bypass::poll_is_on()
+{
+  return (poll_value >> bit) & 1;
+}
+
 
 class Target_cluster_common
 {
@@ -170,9 +196,14 @@ public:
   Target_core *get_core(int i) { return cores[i]; }
   void update_power();
   void set_power(bool is_on);
+  void poll_prepare(std::vector<Cable_io_elem> &list);
+  void poll_update();
   void resume();
+  void resume_prepare(std::vector<Cable_io_elem> &list);
   void halt();
+  void halt_prepare(std::vector<Cable_io_elem> &list);
   void flush();
+  void set_non_stop(bool non_stop);
 
 protected:
   Gdb_server *top;
@@ -185,6 +216,9 @@ protected:
   int cluster_id;
   uint32_t cluster_addr;
   uint32_t xtrigger_addr;
+  uint32_t xtrigger_resume = 0xFFFFFFFF;
+  bool poll_halt_status_valid = false;
+  uint32_t poll_halt_status;
   Target_cache *cache = NULL;
 };
 
@@ -202,11 +236,295 @@ public:
 
 
 
-Target_core::Target_core(Gdb_server *top, uint32_t dbg_unit_addr, int cluster_id, int core_id)
+Target_core::Target_core(Gdb_server *top, uint32_t dbg_unit_addr, int cluster_id, int core_id, js::config *config)
 : top(top), dbg_unit_addr(dbg_unit_addr), cluster_id(cluster_id), core_id(core_id)
 {
   top->log->print(LOG_DEBUG, "Instantiated core\n");
   this->thread_id = first_free_thread_id++;
+
+  // Additional CSRs to be fetched with the registers when the core stops
+  js::config *csrs_config = top->config->get("**/gdb_server/snapshot_csrs");
+  if (csrs_config != NULL)
+  {
+    for (int i=0; i<csrs_config->get_size(); i++)
+    {
+      this->snapshot_csr_ids.push_back(csrs_config->get_elem(i)->get_int());
+    }
+    this->snapshot_csrs.resize(this->snapshot_csr_ids.size());
+  }
+
+  // Each trigger has an address register and a control register, the value
+  // written to the control register depends on the trigger type
+  js::config *triggers_config = config != NULL ? config->get("debug_triggers") : NULL;
+  if (triggers_config != NULL)
+  {
+    js::config *ctrl_config = triggers_config->get("ctrl");
+    this->triggers.resize(triggers_config->get("nb_triggers")->get_int());
+    this->trigger_base = triggers_config->get("base")->get_int();
+    this->trigger_stride = triggers_config->get("stride")->get_int();
+    this->trigger_addr_offset = triggers_config->get("addr_offset")->get_int();
+    this->trigger_ctrl_offset = triggers_config->get("ctrl_offset")->get_int();
+    this->trigger_ctrl[BP_MEMORY] = ctrl_config->get("disabled")->get_int();
+    this->trigger_ctrl[BP_HARDWARE] = ctrl_config->get("exec")->get_int();
+    this->trigger_ctrl[WP_WRITE] = ctrl_config->get("write")->get_int();
+    this->trigger_ctrl[WP_READ] = ctrl_config->get("read")->get_int();
+    this->trigger_ctrl[WP_ACCESS] = ctrl_config->get("access")->get_int();
+
+    // Optional bit set in the control register of the trigger which fired
+    js::config *hit_config = ctrl_config->get("hit");
+    if (hit_config != NULL)
+      this->trigger_hit_mask = hit_config->get_int();
+
+    top->log->debug("Core debug triggers (nb: %d, base: 0x%x)\n", this->triggers.size(), this->trigger_base);
+  }
+}
+
+
+
+bool Target_core::trigger_apply(int index)
+{
+  Target_core_trigger *trigger = &this->triggers[index];
+  uint32_t base = this->trigger_base + index * this->trigger_stride;
+  uint32_t ctrl = trigger->used && trigger->enabled ? this->trigger_ctrl[trigger->type] : this->trigger_ctrl[BP_MEMORY];
+
+  this->top->log->debug("Setting trigger (cluster: %d, core: %d, index: %d, addr: 0x%x, ctrl: 0x%x)\n", cluster_id, core_id, index, trigger->addr, ctrl);
+
+  if (ctrl == this->trigger_ctrl[BP_MEMORY])
+    return this->write(base + this->trigger_ctrl_offset, ctrl);
+
+  return this->write(base + this->trigger_addr_offset, trigger->addr) &&
+    this->write(base + this->trigger_ctrl_offset, ctrl);
+}
+
+
+
+bool Target_core::trigger_insert(int type, uint32_t addr)
+{
+  // GDB inserts the same breakpoint again when its condition is modified
+  for (auto &trigger: this->triggers)
+  {
+    if (trigger.used && trigger.type == type && trigger.addr == addr)
+      return true;
+  }
+
+  for (int i=0; i<this->triggers.size(); i++)
+  {
+    Target_core_trigger *trigger = &this->triggers[i];
+    if (!trigger->used)
+    {
+      trigger->used = true;
+      trigger->enabled = true;
+      trigger->type = type;
+      trigger->addr = addr;
+
+      // The trigger is kept even if the core is off, it is programmed when
+      // the core is switched on
+      if (is_on) this->trigger_apply(i);
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+
+bool Target_core::trigger_remove(int type, uint32_t addr)
+{
+  for (int i=0; i<this->triggers.size(); i++)
+  {
+    Target_core_trigger *trigger = &this->triggers[i];
+    if (trigger->used && trigger->type == type && trigger->addr == addr)
+    {
+      trigger->used = false;
+      if (is_on) this->trigger_apply(i);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+
+bool Target_core::trigger_at(uint32_t addr)
+{
+  for (auto &trigger: this->triggers)
+  {
+    if (trigger.used && trigger.enabled && trigger.type == BP_HARDWARE && trigger.addr == addr)
+      return true;
+  }
+  return false;
+}
+
+
+
+int Target_core::trigger_watch_hit(uint32_t *addr)
+{
+  int hit_index = -1;
+  int nb_watch = 0;
+
+  for (int i=0; i<this->triggers.size(); i++)
+  {
+    Target_core_trigger *trigger = &this->triggers[i];
+    if (!trigger->used || !trigger->enabled || trigger->type < WP_WRITE)
+      continue;
+
+    nb_watch++;
+
+    if (this->trigger_hit_mask == 0)
+    {
+      hit_index = i;
+      continue;
+    }
+
+    uint32_t base = this->trigger_base + i * this->trigger_stride;
+    uint32_t ctrl;
+    if (!this->read(base + this->trigger_ctrl_offset, &ctrl) || !(ctrl & this->trigger_hit_mask))
+      continue;
+
+    // Writing back the control value clears the hit bit
+    this->trigger_apply(i);
+    if (hit_index == -1)
+      hit_index = i;
+  }
+
+  // Without hit bit, the watchpoint is only known if it is the only one
+  if (hit_index == -1 || (this->trigger_hit_mask == 0 && nb_watch != 1))
+    return -1;
+
+  top->log->debug("Stopped on watchpoint (cluster: %d, core: %d, index: %d, addr: 0x%x)\n", cluster_id, core_id, hit_index, this->triggers[hit_index].addr);
+
+  *addr = this->triggers[hit_index].addr;
+  return this->triggers[hit_index].type;
+}
+
+
+
+void Target_core::trigger_enable(uint32_t addr, bool enabled)
+{
+  for (int i=0; i<this->triggers.size(); i++)
+  {
+    Target_core_trigger *trigger = &this->triggers[i];
+    if (trigger->used && trigger->type == BP_HARDWARE && trigger->addr == addr)
+    {
+      trigger->enabled = enabled;
+      this->trigger_apply(i);
+    }
+  }
+}
+
+
+
+bool Target_core::snapshot()
+{
+  if (!is_on || !stopped) return false;
+  if (this->snapshot_valid) return true;
+
+  this->top->log->debug("Taking registers snapshot (cluster: %d, core: %d)\n", cluster_id, core_id);
+
+  std::vector<Cable_io_elem> list;
+  list.push_back(Cable_io_elem(false, dbg_unit_addr + DBG_CTRL_REG, sizeof(this->snapshot_dbg_regs), (char *)this->snapshot_dbg_regs));
+  list.push_back(Cable_io_elem(false, dbg_unit_addr + DBG_NPC_REG, sizeof(this->snapshot_pcs), (char *)this->snapshot_pcs));
+  list.push_back(Cable_io_elem(false, dbg_unit_addr + 0x0400, sizeof(this->snapshot_gprs), (char *)this->snapshot_gprs));
+  for (int i=0; i<this->snapshot_csr_ids.size(); i++)
+  {
+    list.push_back(Cable_io_elem(false, dbg_unit_addr + 0x4000 + this->snapshot_csr_ids[i] * 4, 4, (char *)&this->snapshot_csrs[i]));
+  }
+
+  if (!top->cable->access_list(list))
+    return false;
+
+  this->snapshot_valid = true;
+  this->snapshot_gprs_dirty = 0;
+  this->snapshot_npc_dirty = false;
+
+  return true;
+}
+
+
+
+bool Target_core::snapshot_write_back()
+{
+  std::vector<Cable_io_elem> list;
+
+  this->snapshot_write_back_prepare(list);
+
+  if (list.size() == 0)
+    return true;
+
+  return top->cable->access_list(list);
+}
+
+
+
+void Target_core::snapshot_write_back_prepare(std::vector<Cable_io_elem> &list)
+{
+  if (!is_on || !this->snapshot_valid) return;
+  if (!this->snapshot_gprs_dirty && !this->snapshot_npc_dirty) return;
+
+  this->top->log->debug("Writing back registers snapshot (cluster: %d, core: %d, gprs: 0x%x, npc: %d)\n", cluster_id, core_id, this->snapshot_gprs_dirty, this->snapshot_npc_dirty);
+
+  // Contiguous dirty registers are written with a single access
+  int i = 0;
+  while (i < 32)
+  {
+    if (!((this->snapshot_gprs_dirty >> i) & 1))
+    {
+      i++;
+      continue;
+    }
+
+    int j = i + 1;
+    while (j < 32 && ((this->snapshot_gprs_dirty >> j) & 1))
+      j++;
+
+    list.push_back(Cable_io_elem(true, dbg_unit_addr + 0x0400 + i * 4, (j - i) * 4, (char *)&this->snapshot_gprs[i]));
+
+    i = j;
+  }
+
+  if (this->snapshot_npc_dirty)
+    list.push_back(Cable_io_elem(true, dbg_unit_addr + DBG_NPC_REG, 4, (char *)&this->snapshot_pcs[0]));
+
+  this->snapshot_gprs_dirty = 0;
+  this->snapshot_npc_dirty = false;
+}
+
+
+
+void Target_core::snapshot_invalidate()
+{
+  this->snapshot_valid = false;
+}
+
+
+
+uint32_t *Target_core::snapshot_reg(uint32_t addr)
+{
+  if (!this->snapshot_valid)
+    return NULL;
+
+  if (addr <= DBG_CAUSE_REG)
+    return &this->snapshot_dbg_regs[addr / 4];
+
+  if (addr == DBG_NPC_REG || addr == DBG_PPC_REG)
+    return &this->snapshot_pcs[(addr - DBG_NPC_REG) / 4];
+
+  if (addr >= 0x0400 && addr < 0x0400 + 32 * 4)
+    return &this->snapshot_gprs[(addr - 0x0400) / 4];
+
+  if (addr >= 0x4000)
+  {
+    for (int i=0; i<this->snapshot_csr_ids.size(); i++)
+    {
+      if (0x4000 + this->snapshot_csr_ids[i] * 4 == addr)
+        return &this->snapshot_csrs[i];
+    }
+  }
+
+  return NULL;
 }
 
 
@@ -225,11 +543,52 @@ void Target_core::flush()
 
 void Target_core::read_ppc(uint32_t *ppc)
 {
-  if (!ppc_is_cached) {
-    read(DBG_PPC_REG, &ppc_cached);
-    ppc_is_cached = true;
+  this->read(DBG_PPC_REG, ppc);
+}
+
+
+
+bool Target_core::pc_read(uint32_t *pc)
+{
+  uint32_t npc;
+  uint32_t ppc;
+  uint32_t cause;
+  uint32_t hit;
+
+  if (!this->read(DBG_PPC_REG, &ppc) || !this->read(DBG_NPC_REG, &npc) ||
+    !this->read(DBG_HIT_REG, &hit) || !this->read(DBG_CAUSE_REG, &cause))
+    return false;
+
+  if (hit & 0x1)
+    *pc = npc;
+  else if(cause & (1 << 31)) // interrupt
+    *pc = npc;
+  else if ((cause & 0x1f) == 3)  // breakpoint
+    *pc = ppc;
+  else if ((cause & 0x1f) == 2)
+    *pc = ppc;
+  else if ((cause & 0x1f) == 5)
+    *pc = ppc;
+  else
+    *pc = npc;
+
+  return true;
+}
+
+
+
+bool Target_core::npc_write(uint32_t npc)
+{
+  if (!is_on) return false;
+
+  if (this->snapshot())
+  {
+    this->snapshot_pcs[0] = npc;
+    this->snapshot_npc_dirty = true;
+    return true;
   }
-  *ppc = ppc_cached;
+
+  return this->write(DBG_NPC_REG, npc);
 }
 
 
@@ -239,7 +598,12 @@ bool Target_core::gpr_read_all(uint32_t *data)
   if (!is_on) return false;
   this->top->log->debug("Reading all registers (cluster: %d, core: %d)\n", cluster_id, core_id);
 
-  // Write back the valu
+  if (this->snapshot())
+  {
+    memcpy(data, this->snapshot_gprs, sizeof(this->snapshot_gprs));
+    return true;
+  }
+
   return top->cable->access(false, dbg_unit_addr + 0x0400, 32 * 4, (char*)data);
 }
 
@@ -256,6 +620,14 @@ bool Target_core::gpr_read(unsigned int i, uint32_t *data)
 bool Target_core::gpr_write(unsigned int i, uint32_t data)
 {
   if (!is_on) return false;
+
+  if (this->snapshot())
+  {
+    this->snapshot_gprs[i] = data;
+    this->snapshot_gprs_dirty |= 1 << i;
+    return true;
+  }
+
   return this->write(0x0400 + i * 4, data);
 }
 
@@ -264,10 +636,12 @@ bool Target_core::gpr_write(unsigned int i, uint32_t data)
 void Target_core::commit_resume()
 {
   this->stopped = false;
+  this->resume_pcs_valid = false;
 
   if (!this->is_on) return;
 
-  this->ppc_is_cached = false;
+  this->snapshot_write_back();
+  this->snapshot_invalidate();
   this->commit_step_mode();
   this->write(DBG_HIT_REG, 0);
 }
@@ -291,6 +665,11 @@ void Target_core::set_power(bool is_on)
 
       top->log->print(LOG_DEBUG, "Found a core with id %X (cluster: %d, core: %d)\n", hartid, cluster_id, core_id);
       this->write(DBG_IE_REG, 1<<3);
+      for (int i=0; i<this->triggers.size(); i++)
+      {
+        if (this->triggers[i].used)
+          this->trigger_apply(i);
+      }
       if (!stopped) resume();
     } else {
       top->log->print(LOG_DEBUG, "Setting-off core (cluster: %d, core: %d)\n", cluster_id, core_id);
@@ -300,6 +679,24 @@ void Target_core::set_power(bool is_on)
 }
 
 bool Target_core::read(uint32_t addr, uint32_t* rdata)
+{
+  if (!is_on) return false;
+
+  // While the core is stopped, the registers are served from the snapshot
+  this->snapshot();
+  uint32_t *reg = this->snapshot_reg(addr);
+  if (reg != NULL)
+  {
+    *rdata = *reg;
+    return true;
+  }
+
+  return this->read_hw(addr, rdata);
+}
+
+
+
+bool Target_core::read_hw(uint32_t addr, uint32_t* rdata)
 {
   if (!is_on) return false;
   top->log->print(LOG_DEBUG, "Reading register (addr: 0x%x)\n", dbg_unit_addr + addr);
@@ -311,6 +708,18 @@ bool Target_core::read(uint32_t addr, uint32_t* rdata)
 bool Target_core::write(uint32_t addr, uint32_t wdata)
 {
   if (!is_on) return false;
+
+  // Keep the snapshot coherent, this write supersedes any pending one
+  uint32_t *reg = this->snapshot_reg(addr);
+  if (reg != NULL)
+  {
+    *reg = wdata;
+    if (addr == DBG_NPC_REG)
+      this->snapshot_npc_dirty = false;
+    else if (addr >= 0x0400 && addr < 0x0400 + 32 * 4)
+      this->snapshot_gprs_dirty &= ~(1 << ((addr - 0x0400) / 4));
+  }
+
   top->log->print(LOG_DEBUG, "Writing register (addr: 0x%x, value: 0x%x)\n", dbg_unit_addr + addr, wdata);
   return top->cable->access(true, dbg_unit_addr + addr, 4, (char*)&wdata);
 }
@@ -329,12 +738,14 @@ bool Target_core::is_stopped() {
   if (!is_on) return false;
 
   uint32_t data;
-  if (!this->read(DBG_CTRL_REG, &data)) {
+  if (!this->read_hw(DBG_CTRL_REG, &data)) {
     fprintf(stderr, "debug_is_stopped: Reading from CTRL reg failed\n");
     return false;
   }
 
   this->stopped = data & 0x10000;
+  if (!this->stopped)
+    this->snapshot_invalidate();
 
   top->log->debug("Checking core status (cluster: %d, core: %d, stopped: %d)\n", cluster_id, core_id, this->stopped);
 
@@ -342,6 +753,50 @@ bool Target_core::is_stopped() {
 }
 
 
+void Target_core::poll_prepare(std::vector<Cable_io_elem> &list)
+{
+  this->polled = is_on;
+  if (is_on)
+    list.push_back(Cable_io_elem(false, dbg_unit_addr + DBG_CTRL_REG, 4, (char*)&this->poll_ctrl));
+}
+
+
+
+void Target_core::poll_update()
+{
+  if (!this->polled) return;
+
+  this->poll_set_stopped(this->poll_ctrl & 0x10000);
+}
+
+
+
+void Target_core::poll_set_stopped(bool stopped)
+{
+  if (!is_on) return;
+
+  this->stopped = stopped;
+  if (!this->stopped)
+    this->snapshot_invalidate();
+}
+
+
+
+bool Target_core::wait_halted()
+{
+  if (!is_on) return false;
+
+  if (!top->cable->poll_until(dbg_unit_addr + DBG_CTRL_REG, 1<<16, 1<<16, DBG_HALT_TIMEOUT_US, 0, 1000))
+  {
+    top->log->warning("Core did not halt (cluster: %d, core: %d, timeout: %d us)\n", cluster_id, core_id, DBG_HALT_TIMEOUT_US);
+    return false;
+  }
+
+  return true;
+}
+
+
+
 bool Target_core::stop()
 {
   if (!is_on) return false;
@@ -399,9 +854,21 @@ void Target_core::prepare_resume(bool step)
 
   top->log->debug("Preparing core to resume (step: %d)\n", step);
 
+  // Registers modified by GDB must be there before stepping over a breakpoint
+  this->snapshot_write_back();
+
+  // Breakpoints must be installed to know if we have to step over one
+  this->top->bkp->commit();
+
   // now let's handle software breakpoints
-  uint32_t ppc;
-  this->read_ppc(&ppc);
+  uint32_t ppc, npc;
+  bool pcs_valid = this->resume_pcs_valid && !this->snapshot_valid;
+  this->resume_pcs_valid = false;
+
+  if (pcs_valid)
+    ppc = this->resume_ppc;
+  else
+    this->read_ppc(&ppc);
 
   // if there is a breakpoint at this address, let's remove it and single-step over it
   bool has_stepped = false;
@@ -413,14 +880,31 @@ void Target_core::prepare_resume(bool step)
     this->top->bkp->disable(ppc);
     this->write(DBG_NPC_REG, ppc); // re-execute this instruction
     this->write(DBG_CTRL_REG, 0x1); // single-step
-    while (1) {
-      uint32_t value;
-      this->read(DBG_CTRL_REG, &value);
-      if ((value >> 16) & 1) break;
-    }
+    this->wait_halted();
+    this->snapshot_invalidate();
     this->top->bkp->enable(ppc);
     has_stepped = true;
   }
+  else if (this->has_triggers())
+  {
+    // Same for hardware breakpoints, which stop the core before the
+    // instruction is executed
+    if (pcs_valid)
+      npc = this->resume_npc;
+    else
+      this->read(DBG_NPC_REG, &npc);
+
+    if (this->trigger_at(npc)) {
+      top->log->debug("Core is stopped on a hardware breakpoint, stepping to go over (addr: 0x%x)\n", npc);
+
+      this->trigger_enable(npc, false);
+      this->write(DBG_CTRL_REG, 0x1); // single-step
+      this->wait_halted();
+      this->snapshot_invalidate();
+      this->trigger_enable(npc, true);
+      has_stepped = true;
+    }
+  }
 
   this->set_step_mode(step && !has_stepped);
 }
@@ -430,18 +914,130 @@ void Target_core::prepare_resume(bool step)
 void Target_core::resume()
 {
   this->stopped = false;
+  this->resume_pcs_valid = false;
 
   if (!is_on) return;
 
   this->top->log->debug("Resuming core and committing step mode (cluster: %d, core: %d, step: %d)\n",  cluster_id, core_id, step);
 
+  this->snapshot_write_back();
+  this->snapshot_invalidate();
+
   // clear hit register, has to be done before CTRL
   this->write(DBG_HIT_REG, 0);
 
   this->write(DBG_CTRL_REG, step);
 
   this->commit_step = false;
-  this->ppc_is_cached = false;
+}
+
+
+
+void Target_core::resume_prepare(std::vector<Cable_io_elem> &list, bool commit_only)
+{
+  this->stopped = false;
+  this->resume_pcs_valid = false;
+
+  if (!is_on) return;
+
+  this->snapshot_write_back_prepare(list);
+  this->snapshot_invalidate();
+
+  // When the core is resumed by someone else, only the step mode is
+  // committed, with the halt bit still set, and the hit register is cleared
+  // after it as in commit_resume. The core stays halted, so this order does
+  // not matter. Otherwise the hit register must be cleared before CTRL
+  // resumes the core, so that a new hit is not lost.
+  if (commit_only)
+  {
+    if (this->commit_step)
+    {
+      this->run_ctrl = (1<<16) | step;
+      list.push_back(Cable_io_elem(true, dbg_unit_addr + DBG_CTRL_REG, 4, (char*)&this->run_ctrl));
+      this->commit_step = false;
+    }
+    list.push_back(Cable_io_elem(true, dbg_unit_addr + DBG_HIT_REG, 4, (char*)&this->run_hit));
+  }
+  else
+  {
+    this->run_ctrl = step;
+    list.push_back(Cable_io_elem(true, dbg_unit_addr + DBG_HIT_REG, 4, (char*)&this->run_hit));
+    list.push_back(Cable_io_elem(true, dbg_unit_addr + DBG_CTRL_REG, 4, (char*)&this->run_ctrl));
+    this->commit_step = false;
+  }
+}
+
+
+
+void Target_core::halt_prepare(std::vector<Cable_io_elem> &list)
+{
+  if (!is_on || this->stopped) return;
+
+  // Only the step bit is kept, and it is cached, no need to read CTRL first
+  this->run_ctrl = (1<<16) | step;
+  list.push_back(Cable_io_elem(true, dbg_unit_addr + DBG_CTRL_REG, 4, (char*)&this->run_ctrl));
+}
+
+
+
+void Target_core::resume_pcs_prepare(std::vector<Cable_io_elem> &list)
+{
+  this->resume_pcs_pending = is_on && !this->snapshot_valid;
+  if (!this->resume_pcs_pending) return;
+
+  list.push_back(Cable_io_elem(false, dbg_unit_addr + DBG_PPC_REG, 4, (char*)&this->resume_ppc));
+  list.push_back(Cable_io_elem(false, dbg_unit_addr + DBG_NPC_REG, 4, (char*)&this->resume_npc));
+}
+
+
+
+void Target_core::resume_pcs_update(bool valid)
+{
+  this->resume_pcs_valid = valid && this->resume_pcs_pending;
+  this->resume_pcs_pending = false;
+}
+
+
+
+bool Target_core::range_step(uint32_t start, uint32_t end, int max_steps)
+{
+  uint32_t hit, npc, ctrl;
+  uint32_t hit_clear = 0;
+  uint32_t ctrl_step = 1;
+
+  if (!is_on) return true;
+
+  this->snapshot_write_back();
+  this->snapshot_invalidate();
+
+  // Each step is one cable access list to check where we are and one to step
+  // again, the registers are not read as GDB only needs them at the end
+  for (int i=0; i<max_steps; i++)
+  {
+    std::vector<Cable_io_elem> list;
+    list.push_back(Cable_io_elem(false, dbg_unit_addr + DBG_HIT_REG, 4, (char*)&hit));
+    list.push_back(Cable_io_elem(false, dbg_unit_addr + DBG_NPC_REG, 4, (char*)&npc));
+    if (!top->cable->access_list(list))
+      return true;
+
+    // Anything else than a step, like a breakpoint, is reported to GDB
+    if (!(hit & 1) || npc < start || npc >= end)
+      return true;
+
+    list.clear();
+    list.push_back(Cable_io_elem(true, dbg_unit_addr + DBG_HIT_REG, 4, (char*)&hit_clear));
+    list.push_back(Cable_io_elem(true, dbg_unit_addr + DBG_CTRL_REG, 4, (char*)&ctrl_step));
+    list.push_back(Cable_io_elem(false, dbg_unit_addr + DBG_CTRL_REG, 4, (char*)&ctrl));
+    if (!top->cable->access_list(list))
+      return true;
+
+    if (!((ctrl >> 16) & 1) && !this->wait_halted())
+      return true;
+  }
+
+  top->log->debug("Range step not finished (cluster: %d, core: %d, steps: %d)\n", cluster_id, core_id, max_steps);
+
+  return false;
 }
 
 
@@ -459,7 +1055,7 @@ Target_cluster::Target_cluster(js::config *system_config, js::config *config, Gd
   int nb_pe = config->get("nb_pe")->get_int();
   for (int i=0; i<nb_pe; i++)
   {
-    Target_core *core = new Target_core(top, cluster_base + 0x300000 + i * 0x8000, cluster_id, i);
+    Target_core *core = new Target_core(top, cluster_base + 0x300000 + i * 0x8000, cluster_id, i, config);
     cores.push_back(core);
     nb_core++;
   }
@@ -493,7 +1089,7 @@ Target_cluster::Target_cluster(js::config *system_config, js::config *config, Gd
 Target_fc::Target_fc(js::config *config, Gdb_server *top, uint32_t fc_dbg_base, uint32_t fc_cache_base, int cluster_id)
 : Target_cluster_common(config, top, fc_dbg_base, -1, cluster_id)
 {
-  Target_core *core = new Target_core(top, fc_dbg_base, cluster_id, 0);
+  Target_core *core = new Target_core(top, fc_dbg_base, cluster_id, 0, config);
   cores.push_back(core);
   nb_core++;
 
@@ -556,12 +1152,65 @@ void Target_cluster_common::resume()
 
 
 
+void Target_cluster_common::set_non_stop(bool non_stop)
+{
+  // Applied now if the cluster is on, otherwise when it is switched on
+  ctrl->set_all_stop(!non_stop);
+  if (is_on)
+    ctrl->init();
+}
+
+
+
 void Target_cluster_common::update_power()
 {
   set_power(power->is_on());
 }
 
 
+void Target_cluster_common::poll_prepare(std::vector<Cable_io_elem> &list)
+{
+  power->poll_prepare(list);
+
+  // The cluster controller gives the halt status of all cores in the
+  // register also used to resume them, which saves one access per core
+  this->poll_halt_status_valid = xtrigger_addr != -1 && is_on;
+  if (this->poll_halt_status_valid)
+  {
+    list.push_back(Cable_io_elem(false, xtrigger_addr + 0x00200000 + 0x28, 4, (char*)&this->poll_halt_status));
+    return;
+  }
+
+  // Only cores which are known to be on can be accessed
+  for (auto &core: cores)
+  {
+    core->poll_prepare(list);
+  }
+}
+
+
+
+void Target_cluster_common::poll_update()
+{
+  set_power(power->poll_is_on());
+
+  if (this->poll_halt_status_valid)
+  {
+    for (int i=0; i<nb_core; i++)
+    {
+      cores[i]->poll_set_stopped((this->poll_halt_status >> i) & 1);
+    }
+    return;
+  }
+
+  for (auto &core: cores)
+  {
+    core->poll_update();
+  }
+}
+
+
+
 void Target_cluster_common::set_power(bool is_on)
 {
   this->top->log->debug("Set cluster power (cluster: %d, is_on: %d)\n", cluster_id, is_on);
@@ -585,6 +1234,36 @@ void Target_cluster_common::set_power(bool is_on)
 
 
 
+void Target_cluster_common::resume_prepare(std::vector<Cable_io_elem> &list)
+{
+  this->top->log->debug("Preparing cluster resume (cluster: %d)\n", cluster_id);
+
+  if (xtrigger_addr != -1) {
+    // Same as resume, the step mode of each core is committed before all
+    // cores are resumed through the global register
+    for (auto &core: cores) {
+      core->resume_prepare(list, true);
+    }
+
+    if (is_on) {
+      list.push_back(Cable_io_elem(true, xtrigger_addr + 0x00200000 + 0x28, 4, (char*)&this->xtrigger_resume));
+    }
+  } else {
+    for (auto &core: cores) {
+      core->resume_prepare(list, false);
+    }
+  }
+}
+
+
+
+void Target_cluster_common::halt_prepare(std::vector<Cable_io_elem> &list)
+{
+  cores.front()->halt_prepare(list);
+}
+
+
+
 void Target_cluster_common::halt()
 {
   this->top->log->debug("Halting cluster (cluster: %d)\n", cluster_id);
@@ -687,9 +1366,38 @@ void Target::flush()
 
 void Target::resume_all()
 {
+  this->top->bkp->commit();
+  this->top->mem_cache->invalidate();
+
+  // All clusters are resumed with one access list to limit the skew
+  // between them
+  std::vector<Cable_io_elem> list;
+
   for (auto &cluster : this->clusters)
   {
-    cluster->resume();
+    cluster->resume_prepare(list);
+  }
+
+  if (list.size() && !this->top->cable->access_list(list))
+    this->top->log->warning("Failed to resume cores\n");
+}
+
+
+
+void Target::resume_pcs_fetch()
+{
+  std::vector<Cable_io_elem> list;
+
+  for (auto &core : this->cores)
+  {
+    core->resume_pcs_prepare(list);
+  }
+
+  bool valid = list.size() == 0 || this->top->cable->access_list(list);
+
+  for (auto &core : this->cores)
+  {
+    core->resume_pcs_update(valid);
   }
 }
 
@@ -697,13 +1405,18 @@ void Target::resume_all()
 
 void Target::resume(bool step, int tid)
 {
+  this->top->mem_cache->invalidate();
+
   if (tid == -1)
   {
+    this->resume_pcs_fetch();
+
     for (auto &thread : this->get_threads())
     {
       thread->prepare_resume(step);
-      this->resume_all();
     }
+
+    this->resume_all();
   }
   else
   {
@@ -732,10 +1445,56 @@ void Target::update_power()
 
 
 
+void Target::poll()
+{
+  std::vector<Cable_io_elem> list;
+
+  for (auto &cluster: clusters)
+  {
+    cluster->poll_prepare(list);
+  }
+
+  if (!top->cable->access_list(list))
+  {
+    // Some cluster may have been switched off meanwhile, go through the
+    // slow path which checks the power first
+    this->update_power();
+    for (auto &core: cores)
+    {
+      core->is_stopped();
+    }
+    return;
+  }
+
+  for (auto &cluster: clusters)
+  {
+    cluster->poll_update();
+  }
+}
+
+
+
+void Target::set_non_stop(bool non_stop)
+{
+  this->top->log->debug("Setting non-stop mode (non_stop: %d)\n", non_stop);
+
+  for (auto &cluster: this->clusters)
+  {
+    cluster->set_non_stop(non_stop);
+  }
+}
+
+
+
 void Target::halt()
 {
+  std::vector<Cable_io_elem> list;
+
   for (auto &cluster: this->clusters)
   {
-    cluster->halt();
+    cluster->halt_prepare(list);
   }
+
+  if (list.size() && !this->top->cable->access_list(list))
+    this->top->log->warning("Failed to halt cores\n");
 }
\ No newline at end of file
@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2018 ETH Zurich and University of Bologna
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "mem_watch.hpp"
+
+
+Mem_watch::Mem_watch(Log *log, Cable *cable, const char *path, bool binary, int period_us)
+: log(log), cable(cable), binary(binary), period_us(period_us)
+{
+  this->end = false;
+  this->file = fopen(path, binary ? "wb" : "w");
+  if (this->file == NULL)
+    log->error("Failed to open memory watch output (path: %s, error: %s)\n", path, strerror(errno));
+}
+
+
+
+Mem_watch::~Mem_watch()
+{
+  this->stop();
+}
+
+
+
+bool Mem_watch::add(const char *name, unsigned int addr, int size, int count)
+{
+  if ((size != 1 && size != 2 && size != 4 && size != 8) || count <= 0)
+  {
+    log->warning("Invalid memory watch entry (name: %s, size: %d, count: %d)\n", name, size, count);
+    return false;
+  }
+
+  Mem_watch_entry entry;
+  entry.name = name;
+  entry.addr = addr;
+  entry.size = size;
+  entry.count = count;
+  entry.offset = this->data.size();
+
+  this->entries.push_back(entry);
+  this->data.resize(this->data.size() + size * count);
+
+  return true;
+}
+
+
+
+bool Mem_watch::start()
+{
+  if (this->file == NULL)
+    return false;
+
+  log->debug("Starting memory watch (entries: %d, period: %d us)\n", this->entries.size(), this->period_us);
+
+  if (!this->binary)
+  {
+    fprintf(this->file, "time_us");
+    for (auto &entry: this->entries)
+    {
+      if (entry.count == 1)
+        fprintf(this->file, ",%s", entry.name.c_str());
+      else
+      {
+        for (int i=0; i<entry.count; i++)
+          fprintf(this->file, ",%s[%d]", entry.name.c_str(), i);
+      }
+    }
+    fprintf(this->file, "\n");
+  }
+
+  this->start_time = std::chrono::steady_clock::now();
+  this->thread = new std::thread(&Mem_watch::watch_routine, this);
+
+  return true;
+}
+
+
+
+bool Mem_watch::sample()
+{
+  std::vector<Cable_io_elem> list;
+
+  for (auto &entry: this->entries)
+  {
+    list.push_back(Cable_io_elem(false, entry.addr, entry.size * entry.count, (char *)&this->data[entry.offset]));
+  }
+
+  // The lock is held so that the sample is not interleaved with accesses
+  // from other users of the cable, the timestamp is taken in the middle
+  this->cable->lock();
+  auto before = std::chrono::steady_clock::now();
+  bool result = this->cable->access_list(list);
+  auto after = std::chrono::steady_clock::now();
+  this->cable->unlock();
+
+  if (!result)
+    return false;
+
+  uint64_t timestamp = std::chrono::duration_cast<std::chrono::microseconds>(before + (after - before) / 2 - this->start_time).count();
+
+  if (this->binary)
+  {
+    fwrite(&timestamp, sizeof(timestamp), 1, this->file);
+    fwrite(this->data.data(), 1, this->data.size(), this->file);
+  }
+  else
+  {
+    fprintf(this->file, "%" PRIu64, timestamp);
+    for (auto &entry: this->entries)
+    {
+      for (int i=0; i<entry.count; i++)
+      {
+        uint64_t value = 0;
+        memcpy(&value, &this->data[entry.offset + i * entry.size], entry.size);
+        fprintf(this->file, ",%" PRIu64, value);
+      }
+    }
+    fprintf(this->file, "\n");
+  }
+
+  this->nb_samples++;
+
+  return true;
+}
+
+
+
+void Mem_watch::watch_routine()
+{
+  auto next = std::chrono::steady_clock::now();
+
+  while (!this->end)
+  {
+    if (!this->sample())
+      this->log->warning("Failed to sample memory\n");
+
+    next += std::chrono::microseconds(this->period_us);
+    auto now = std::chrono::steady_clock::now();
+
+    // Don't try to catch up if the cable is slower than the period
+    if (next < now)
+      next = now;
+    else
+      std::this_thread::sleep_until(next);
+  }
+}
+
+
+
+int Mem_watch::stop()
+{
+  if (this->thread != NULL)
+  {
+    this->end = true;
+    this->thread->join();
+    delete this->thread;
+    this->thread = NULL;
+  }
+
+  if (this->file != NULL)
+  {
+    fclose(this->file);
+    this->file = NULL;
+  }
+
+  return this->nb_samples;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2018 ETH Zurich and University of Bologna
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __MEM_WATCH_HPP__
+#define __MEM_WATCH_HPP__
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+
+#include "cable.hpp"
+#include "cables/log.h"
+
+class Mem_watch_entry
+{
+public:
+  std::string name;
+  unsigned int addr;
+  // Size of one element, the entry is an array if count is more than 1
+  int size;
+  int count;
+  int offset;
+};
+
+// Samples a list of memory locations at a fixed rate while the target is
+// running, without stopping it. Each sample is one batched read done with
+// the cable lock held, and is streamed to a file with the host timestamp,
+// either as CSV or as binary records (64-bit timestamp in us followed by the
+// raw content of all entries).
+class Mem_watch
+{
+public:
+  Mem_watch(Log *log, Cable *cable, const char *path, bool binary, int period_us);
+  ~Mem_watch();
+
+  // Element sizes can only be 1, 2, 4 or 8 bytes, returns false otherwise
+  bool add(const char *name, unsigned int addr, int size, int count);
+  bool start();
+
+  // Stops sampling and closes the file, returns the number of samples
+  int stop();
+
+private:
+  void watch_routine();
+  bool sample();
+
+  Log *log;
+  Cable *cable;
+  FILE *file;
+  bool binary;
+  int period_us;
+
+  std::vector<Mem_watch_entry> entries;
+  std::vector<uint8_t> data;
+  std::chrono::steady_clock::time_point start_time;
+  int nb_samples = 0;
+
+  std::atomic<bool> end;
+  std::thread *thread = NULL;
+};
+
+#endif
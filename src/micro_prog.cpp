@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2018 ETH Zurich and University of Bologna
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+
+#include "micro_prog.hpp"
+
+
+Micro_prog::Micro_prog(Log *log, Cable *cable) : log(log), cable(cable)
+{
+}
+
+
+
+bool Micro_prog::flush()
+{
+  bool result = true;
+
+  if (this->pending.size())
+    result = this->cable->access_list(this->pending);
+
+  this->pending.clear();
+  this->write_values.clear();
+
+  return result;
+}
+
+
+
+bool Micro_prog::poll(unsigned int addr, uint32_t mask, uint32_t value, int timeout_us, bool negate)
+{
+  return this->cable->poll_until(addr, mask, value, timeout_us, 100, 10000, negate);
+}
+
+
+
+bool Micro_prog::jtag_poll(unsigned int reg, int width, unsigned int value, int ir_len, uint32_t mask, uint32_t expected, int timeout_us)
+{
+  // The JTAG registers are polled without delay as the boot code only
+  // keeps them in the expected state for a short time
+  Poll_backoff backoff(timeout_us);
+
+  while (1)
+  {
+    unsigned int data;
+    if (!this->cable->jtag_get_reg(reg, width, &data, value, ir_len))
+      return false;
+    if ((data & mask) == expected)
+      return true;
+    if (!backoff.wait())
+      return false;
+  }
+}
+
+
+
+bool Micro_prog::exec(const uint32_t *code, int size, uint32_t *captures, int nb_captures)
+{
+  static const int nb_args[] = { 0, 3, 3, 3, 5, 1, 4, 5, 7, 2, 1, 1 };
+  int pc = 0;
+  bool result = true;
+
+  this->cable->lock();
+
+  while (pc < size)
+  {
+    uint32_t opcode = code[pc];
+    const uint32_t *args = &code[pc + 1];
+
+    if (opcode >= sizeof(nb_args) / sizeof(nb_args[0]) || pc + 1 + nb_args[opcode] > size)
+    {
+      log->warning("Invalid micro-program instruction (pc: %d, opcode: 0x%x)\n", pc, opcode);
+      result = false;
+      break;
+    }
+
+    if (opcode == MP_END)
+      break;
+
+    // Only memory accesses can be queued, anything else must see them done
+    if (opcode != MP_WRITE && opcode != MP_READ)
+    {
+      if (!this->flush())
+      {
+        result = false;
+        break;
+      }
+    }
+
+    // Values and capture slots are 32 bits, bigger accesses would overflow them
+    if ((opcode == MP_WRITE || opcode == MP_READ) && args[1] != 1 && args[1] != 2 && args[1] != 4)
+    {
+      log->warning("Invalid micro-program access size (pc: %d, size: %d)\n", pc, args[1]);
+      result = false;
+      break;
+    }
+
+    switch (opcode)
+    {
+      case MP_WRITE:
+        this->write_values.push_back(args[2]);
+        this->pending.push_back(Cable_io_elem(true, args[0], args[1], (char *)&this->write_values.back()));
+        break;
+
+      case MP_READ:
+        if (args[2] >= (uint32_t)nb_captures)
+        {
+          result = false;
+          break;
+        }
+        captures[args[2]] = 0;
+        this->pending.push_back(Cable_io_elem(false, args[0], args[1], (char *)&captures[args[2]]));
+        break;
+
+      case MP_RMW:
+      {
+        uint32_t value;
+        result = this->cable->access(false, args[0], 4, (char *)&value);
+        if (result)
+        {
+          value = (value & ~args[1]) | (args[2] & args[1]);
+          result = this->cable->access(true, args[0], 4, (char *)&value);
+        }
+        break;
+      }
+
+      case MP_POLL:
+        result = this->poll(args[0], args[1], args[2], args[3], args[4]);
+        break;
+
+      case MP_DELAY:
+        usleep(args[0]);
+        break;
+
+      case MP_JTAG_SET:
+        result = this->cable->jtag_set_reg(args[0], args[1], args[2], (int)args[3]);
+        break;
+
+      case MP_JTAG_GET:
+      {
+        unsigned int data;
+        if (args[4] >= (uint32_t)nb_captures)
+        {
+          result = false;
+          break;
+        }
+        result = this->cable->jtag_get_reg(args[0], args[1], &data, args[2], (int)args[3]);
+        captures[args[4]] = data;
+        break;
+      }
+
+      case MP_JTAG_POLL:
+        result = this->jtag_poll(args[0], args[1], args[2], (int)args[3], args[4], args[5], args[6]);
+        break;
+
+      // Not all cables implement the reset and config pins, failures are
+      // ignored like when they are driven from the host
+      case MP_CHIP_RESET:
+        this->cable->chip_reset(args[0], args[1]);
+        break;
+
+      case MP_CHIP_CONFIG:
+        this->cable->chip_config(args[0]);
+        break;
+
+      case MP_JTAG_RESET:
+        this->cable->jtag_reset(args[0]);
+        break;
+    }
+
+    if (!result)
+    {
+      log->warning("Micro-program instruction failed (pc: %d, opcode: 0x%x)\n", pc, opcode);
+      break;
+    }
+
+    pc += 1 + nb_args[opcode];
+  }
+
+  if (!this->flush() && result)
+  {
+    log->warning("Micro-program accesses failed\n");
+    result = false;
+  }
+
+  this->cable->unlock();
+
+  return result;
+}
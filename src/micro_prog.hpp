@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2018 ETH Zurich and University of Bologna
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __MICRO_PROG_HPP__
+#define __MICRO_PROG_HPP__
+
+#include <deque>
+#include <vector>
+#include <stdint.h>
+
+#include "cable.hpp"
+#include "cables/log.h"
+
+// Opcodes of the micro-programs, each followed by its 32-bit arguments.
+// They must be kept in sync with python/bridge/micro_prog.py.
+#define MP_END          0x00  //
+#define MP_WRITE        0x01  // addr, size, value
+#define MP_READ         0x02  // addr, size, slot
+#define MP_RMW          0x03  // addr, mask, value
+#define MP_POLL         0x04  // addr, mask, value, timeout_us, negate
+#define MP_DELAY        0x05  // duration_us
+#define MP_JTAG_SET     0x06  // reg, width, value, ir_len
+#define MP_JTAG_GET     0x07  // reg, width, value, ir_len, slot
+#define MP_JTAG_POLL    0x08  // reg, width, value, ir_len, mask, expected, timeout_us
+#define MP_CHIP_RESET   0x09  // active, duration
+#define MP_CHIP_CONFIG  0x0a  // value
+#define MP_JTAG_RESET   0x0b  // active
+
+// Executes a sequence of cable operations compiled by the host, so that a
+// whole reset or init sequence is one call instead of one round-trip per
+// access. Consecutive memory reads and writes are queued and issued as one
+// access list, which is flushed before any operation depending on them.
+class Micro_prog
+{
+public:
+  Micro_prog(Log *log, Cable *cable);
+
+  // Runs the program with the cable locked, the values read are stored in
+  // the capture slots. Returns false as soon as an operation fails.
+  bool exec(const uint32_t *code, int size, uint32_t *captures, int nb_captures);
+
+private:
+  bool flush();
+  bool poll(unsigned int addr, uint32_t mask, uint32_t value, int timeout_us, bool negate);
+  bool jtag_poll(unsigned int reg, int width, unsigned int value, int ir_len, uint32_t mask, uint32_t expected, int timeout_us);
+
+  Log *log;
+  Cable *cable;
+
+  std::vector<Cable_io_elem> pending;
+  // Values of the queued writes, a deque keeps them at the same address
+  // until the list is flushed
+  std::deque<uint32_t> write_values;
+};
+
+#endif
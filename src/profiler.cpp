@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2018 ETH Zurich and University of Bologna
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+
+#include "profiler.hpp"
+
+#define DBG_CTRL_REG  0x0000
+#define DBG_PPC_REG   0x2004
+
+
+Profiler::Profiler(js::config *system_config, Log *log, Cable *cable, int period_us, int ring_size)
+: log(log), cable(cable), period_us(period_us)
+{
+  // The cores are found the same way as for the GDB server
+  js::config *fc_config = system_config->get("**/soc/fc");
+  if (fc_config != NULL)
+  {
+    Profiler_cluster cluster;
+    cluster.is_on = true;
+    clusters.push_back(cluster);
+
+    Profiler_core core;
+    core.dbg_unit_addr = system_config->get("**/fc_dbg_unit/base")->get_int();
+    core.id = fc_config->get("cluster_id")->get_int() << 16;
+    core.cluster = clusters.size() - 1;
+    cores.push_back(core);
+  }
+
+  js::config *cluster_config = system_config->get("**/soc/cluster");
+  if (cluster_config != NULL)
+  {
+    int nb_clusters = system_config->get("**/nb_cluster")->get_int();
+    int nb_pe = cluster_config->get("nb_pe")->get_int();
+    unsigned int cluster_base = 0x10000000;
+    js::config *base_config = system_config->get("**/cluster/base");
+    if (base_config != NULL)
+      cluster_base = base_config->get_int();
+
+    for (int i=0; i<nb_clusters; i++)
+    {
+      Profiler_cluster cluster;
+
+      js::config *bypass_config = system_config->get("**/apb_soc_ctrl/regmap/power/bypass");
+      if (bypass_config)
+      {
+        cluster.power_addr = system_config->get("**/apb_soc_ctrl/base")->get_int() +
+          bypass_config->get("offset")->get_int();
+        cluster.power_bit = bypass_config->get("content/dbg1/bit")->get_int();
+      }
+      else
+      {
+        cluster.is_on = true;
+      }
+
+      clusters.push_back(cluster);
+
+      for (int j=0; j<nb_pe; j++)
+      {
+        Profiler_core core;
+        core.dbg_unit_addr = cluster_base + 0x400000 * i + 0x300000 + j * 0x8000;
+        core.id = (i << 16) | j;
+        core.cluster = clusters.size() - 1;
+        cores.push_back(core);
+      }
+    }
+  }
+
+  int size = 1;
+  while (size < ring_size)
+    size <<= 1;
+
+  this->ring.resize(size);
+  this->ring_mask = size - 1;
+  this->ring_write = 0;
+  this->ring_read = 0;
+  this->end = false;
+
+  log->debug("Starting profiler (cores: %d, period: %d us, ring size: %d)\n", cores.size(), period_us, size);
+
+  thread = new std::thread(&Profiler::sampler_routine, this);
+}
+
+
+
+Profiler::~Profiler()
+{
+  this->stop();
+}
+
+
+
+bool Profiler::sample()
+{
+  std::vector<Cable_io_elem> power_list;
+
+  // The power state is read first so that the debug units of clusters which
+  // are off are never accessed
+  for (auto &cluster: this->clusters)
+  {
+    if (cluster.power_addr != (uint32_t)-1)
+      power_list.push_back(Cable_io_elem(false, cluster.power_addr, 4, (char *)&cluster.power_value));
+  }
+
+  if (power_list.size())
+  {
+    if (!this->cable->access_list(power_list))
+      return false;
+
+    for (auto &cluster: this->clusters)
+    {
+      if (cluster.power_addr != (uint32_t)-1)
+        cluster.is_on = (cluster.power_value >> cluster.power_bit) & 1;
+    }
+  }
+
+  std::vector<Cable_io_elem> list;
+  std::vector<Profiler_core *> sampled;
+  for (auto &core: this->cores)
+  {
+    if (!this->clusters[core.cluster].is_on)
+      continue;
+
+    list.push_back(Cable_io_elem(false, core.dbg_unit_addr + DBG_CTRL_REG, 4, (char *)&core.ctrl));
+    list.push_back(Cable_io_elem(false, core.dbg_unit_addr + DBG_PPC_REG, 4, (char *)&core.ppc));
+    sampled.push_back(&core);
+  }
+
+  if (list.size() && !this->cable->access_list(list))
+    return false;
+
+  unsigned int write = this->ring_write.load(std::memory_order_relaxed);
+  unsigned int read = this->ring_read.load(std::memory_order_acquire);
+
+  for (auto core: sampled)
+  {
+    // Halted cores are not running code
+    if ((core->ctrl >> 16) & 1)
+      continue;
+
+    if (write - read > this->ring_mask)
+    {
+      this->dropped++;
+      continue;
+    }
+
+    Profiler_sample *sample = &this->ring[write & this->ring_mask];
+    sample->core = core->id;
+    sample->pc = core->ppc;
+    write++;
+  }
+
+  this->ring_write.store(write, std::memory_order_release);
+
+  return true;
+}
+
+
+
+void Profiler::sampler_routine()
+{
+  auto next = std::chrono::steady_clock::now();
+
+  while (!this->end)
+  {
+    if (!this->sample())
+    {
+      this->log->warning("Failed to sample cores\n");
+    }
+
+    next += std::chrono::microseconds(this->period_us);
+    auto now = std::chrono::steady_clock::now();
+
+    // Don't try to catch up if the cable is slower than the period
+    if (next < now)
+      next = now;
+    else
+      std::this_thread::sleep_until(next);
+  }
+}
+
+
+
+int Profiler::read(Profiler_sample *samples, int max)
+{
+  unsigned int read = this->ring_read.load(std::memory_order_relaxed);
+  unsigned int write = this->ring_write.load(std::memory_order_acquire);
+  int count = 0;
+
+  while (read != write && count < max)
+  {
+    samples[count++] = this->ring[read & this->ring_mask];
+    read++;
+  }
+
+  this->ring_read.store(read, std::memory_order_release);
+
+  return count;
+}
+
+
+
+int Profiler::stop()
+{
+  if (this->thread != NULL)
+  {
+    this->end = true;
+    this->thread->join();
+    delete this->thread;
+    this->thread = NULL;
+  }
+
+  return this->dropped;
+}
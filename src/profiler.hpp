@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2018 ETH Zurich and University of Bologna
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __PROFILER_HPP__
+#define __PROFILER_HPP__
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "json.hpp"
+#include "cable.hpp"
+#include "cables/log.h"
+
+class Profiler_sample
+{
+public:
+  // (cluster_id << 16) | core_id
+  uint32_t core;
+  uint32_t pc;
+};
+
+class Profiler_core
+{
+public:
+  uint32_t dbg_unit_addr;
+  uint32_t id;
+  int cluster;
+  uint32_t ctrl;
+  uint32_t ppc;
+};
+
+class Profiler_cluster
+{
+public:
+  // Power register telling if the cluster is on, or -1 if it is always on
+  uint32_t power_addr = -1;
+  int power_bit;
+  uint32_t power_value;
+  bool is_on = false;
+};
+
+// Statistical profiler sampling the PC of all running cores while the
+// target is running. Each sample of all cores is one cable access list,
+// and samples are pushed by the sampling thread into a single-producer
+// single-consumer ring from which they are read by the host.
+class Profiler
+{
+public:
+  Profiler(js::config *system_config, Log *log, Cable *cable, int period_us, int ring_size);
+  ~Profiler();
+
+  // Copies at most max samples from the ring, returns how many were copied
+  int read(Profiler_sample *samples, int max);
+
+  // Stops sampling, returns the number of samples dropped because the ring
+  // was full
+  int stop();
+
+private:
+  void sampler_routine();
+  bool sample();
+
+  Log *log;
+  Cable *cable;
+  int period_us;
+
+  std::vector<Profiler_cluster> clusters;
+  std::vector<Profiler_core> cores;
+
+  std::vector<Profiler_sample> ring;
+  unsigned int ring_mask;
+  std::atomic<unsigned int> ring_write;
+  std::atomic<unsigned int> ring_read;
+  unsigned int dropped = 0;
+
+  std::atomic<bool> end;
+  std::thread *thread = NULL;
+};
+
+#endif
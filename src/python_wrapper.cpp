@@ -31,6 +31,9 @@
 #include "cables/ftdi/ftdi.hpp"
 #endif
 #include "gdb-server/gdb-server.hpp"
+#include "profiler.hpp"
+#include "mem_watch.hpp"
+#include "micro_prog.hpp"
 
 using namespace std;
 
@@ -153,6 +156,24 @@ extern "C" void cable_read(void *cable, unsigned int addr, int size, const char
   adu->access(false, addr, size, (char *)data);
 }
 
+extern "C" bool cable_fill(void *cable, unsigned int addr, int size, const char *pattern, int pattern_len)
+{
+  Adv_dbg_itf *adu = (Adv_dbg_itf *)cable;
+  return adu->fill(addr, size, pattern, pattern_len);
+}
+
+extern "C" bool cable_poll_until(void *cable, unsigned int addr, uint32_t mask, uint32_t value, int timeout_us, int min_us, int max_us, bool negate, uint32_t *last)
+{
+  Adv_dbg_itf *adu = (Adv_dbg_itf *)cable;
+  return adu->poll_until(addr, mask, value, timeout_us, min_us, max_us, negate, last);
+}
+
+extern "C" bool cable_barrier(void *cable)
+{
+  Adv_dbg_itf *adu = (Adv_dbg_itf *)cable;
+  return adu->barrier();
+}
+
 extern "C" void cable_reg_write(void *cable, unsigned int addr, const char *data, int device)
 {
   Adv_dbg_itf *adu = (Adv_dbg_itf *)cable;
@@ -202,6 +223,14 @@ extern "C" bool cable_jtag_get_reg(void *handler, unsigned int reg, int width, u
   return cable->jtag_get_reg(reg, width, out_value, value, ir_len);
 }
 
+extern "C" bool cable_exec_prog(void *handler, const uint32_t *code, int size, uint32_t *captures, int nb_captures)
+{
+  Cable *cable = (Cable *)handler;
+  Log log;
+  Micro_prog prog(&log, cable);
+  return prog.exec(code, size, captures, nb_captures);
+}
+
 extern "C" void cable_lock(void *handler)
 {
   Cable *cable = (Cable *)handler;
@@ -251,6 +280,51 @@ extern "C" void gdb_server_close(void *arg, int kill)
   server->stop(kill);
 }
 
+extern "C" void *profiler_open(void *cable, int period_us, int ring_size)
+{
+  return (void *)new Profiler(system_config, new Log(), (Cable *)cable, period_us, ring_size);
+}
+
+// Samples are returned as pairs of core identifier and PC
+extern "C" int profiler_read(void *arg, uint32_t *buffer, int max)
+{
+  Profiler *profiler = (Profiler *)arg;
+  return profiler->read((Profiler_sample *)buffer, max);
+}
+
+extern "C" int profiler_close(void *arg)
+{
+  Profiler *profiler = (Profiler *)arg;
+  int dropped = profiler->stop();
+  delete profiler;
+  return dropped;
+}
+
+extern "C" void *mem_watch_open(void *cable, const char *path, int binary, int period_us)
+{
+  return (void *)new Mem_watch(new Log(), (Cable *)cable, path, binary, period_us);
+}
+
+extern "C" bool mem_watch_add(void *arg, const char *name, unsigned int addr, int size, int count)
+{
+  Mem_watch *watch = (Mem_watch *)arg;
+  return watch->add(name, addr, size, count);
+}
+
+extern "C" bool mem_watch_start(void *arg)
+{
+  Mem_watch *watch = (Mem_watch *)arg;
+  return watch->start();
+}
+
+extern "C" int mem_watch_close(void *arg)
+{
+  Mem_watch *watch = (Mem_watch *)arg;
+  int nb_samples = watch->stop();
+  delete watch;
+  return nb_samples;
+}
+
 
 
 
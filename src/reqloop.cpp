@@ -19,6 +19,7 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <thread>
 #include "cable.hpp"
 #include "cables/log.h"
@@ -27,6 +28,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <future>
 #include <mutex>
 #include <queue>
 #include <condition_variable>
@@ -35,6 +39,27 @@
 #include <SDL.h>
 #endif
 
+// Part of the debug struct read in one burst at each iteration of the
+// request loop, from the exit status to the end of the structure
+#define DEBUG_STRUCT_HOT_START offsetof(hal_debug_struct_t, exit_status)
+#define DEBUG_STRUCT_HOT_SIZE  (sizeof(hal_debug_struct_t) - DEBUG_STRUCT_HOT_START)
+// The ring buffers are only there from protocol version 5
+#define DEBUG_STRUCT_HOT_SIZE_V4 (offsetof(hal_debug_struct_t, up_rings) - DEBUG_STRUCT_HOT_START)
+
+#define DEBUG_RING_NAME_SIZE 32
+
+// File reads and writes are split in chunks of this number of cable bursts,
+// so that the host file access of one chunk overlaps the transfer of the
+// other one
+#define REQLOOP_IO_CHUNK_BURSTS 8
+
+// Default polling of the target. After some activity, the loop polls
+// without delay for a few iterations, and then backs off from the minimum
+// delay up to the maximum one. They can be overwritten by the configuration.
+#define REQLOOP_POLL_BURST   16
+#define REQLOOP_POLL_MIN_US  10
+#define REQLOOP_POLL_MAX_US  1000
+
 typedef enum 
 {
   TARGET_SYNC_FSM_STATE_INIT,
@@ -52,6 +77,20 @@ public:
   hal_bridge_req_t target_req;
 };
 
+// Host side of a ring buffer channel, resolved from the channel name the
+// first time the ring is seen. Up channels named stdout and stderr go to the
+// host ones, the other ones are dumped to the file channel_<name>.bin in the
+// current directory.
+// Only the stdin down channel is supported.
+class Reqloop_channel
+{
+public:
+  uint32_t name_addr = 0;
+  std::string name;
+  FILE *file = NULL;
+  int fd = -1;
+};
+
 class Reqloop
 {
 public:
@@ -75,6 +114,7 @@ private:
   bool handle_req_open(hal_debug_struct_t *debug_struct, hal_bridge_req_t *target_req, hal_bridge_req_t *req);
   bool handle_req_read(hal_debug_struct_t *debug_struct, hal_bridge_req_t *target_req, hal_bridge_req_t *req);
   bool handle_req_write(hal_debug_struct_t *debug_struct, hal_bridge_req_t *target_req, hal_bridge_req_t *req);
+  int read_mapped(int file, uint32_t ptr, int size);
   bool handle_req_close(hal_debug_struct_t *debug_struct, hal_bridge_req_t *target_req, hal_bridge_req_t *req);
   bool handle_req_fb_open(hal_debug_struct_t *debug_struct, hal_bridge_req_t *req, hal_bridge_req_t *target_req);
   bool handle_req_fb_update(hal_debug_struct_t *debug_struct, hal_bridge_req_t *req, hal_bridge_req_t *target_req);
@@ -85,9 +125,19 @@ private:
   void update_target_status(hal_debug_struct_t *debug_struct);
   void wait_target_available(hal_debug_struct_t *debug_struct);
 
+  Reqloop_channel *get_channel(Reqloop_channel *channel, hal_debug_ring_t *ring, bool up);
+  bool handle_rings(hal_debug_struct_t *debug_struct);
+  void close_channels();
+
+  void poll_activity();
+  void poll_wait();
+
   void notif_target(hal_debug_struct_t *debug_struct);
+  void notif_target_prepare(std::vector<Cable_io_elem> &list);
+  void snapshot_prepare(std::vector<Cable_io_elem> &list);
+  bool snapshot_update();
   void handle_target_req(hal_debug_struct_t *debug_struct, Target_req *target_req);
-  void handle_bridge_to_target_reqs(hal_debug_struct_t *debug_struct);
+  bool handle_bridge_to_target_reqs(hal_debug_struct_t *debug_struct);
 
   bool wait_target_request();
   unsigned int get_target_state();
@@ -108,12 +158,25 @@ private:
   std::queue<Target_req *> target_reqs;
 
   std::mutex mutex;
+  // Used both to notify the requesters that their request is done and to
+  // wake up the loop when a request is queued
   std::condition_variable cond;
 
+  Poll_backoff poll_backoff;
+  int poll_burst;
+  int poll_burst_count = 0;
+
   target_sync_fsm_state_e target_sync_fsm_state;
   unsigned int jtag_val;
 
   hal_debug_struct_t *debug_struct = NULL;
+  // Local copy of the hot part of the debug struct, updated once per
+  // iteration of the request loop
+  hal_debug_struct_t snapshot;
+  uint32_t protocol_version = PROTOCOL_VERSION_4;
+
+  Reqloop_channel up_channels[HAL_DEBUG_NB_RINGS];
+  Reqloop_channel down_channels[HAL_DEBUG_NB_RINGS];
 
   bool target_jtag_sync;
 
@@ -322,6 +385,7 @@ int Reqloop::stop(bool kill)
 {
   if (kill) end = true;
   thread->join();
+  this->close_channels();
   return status;
 }
 
@@ -336,12 +400,14 @@ void Reqloop::activate()
       uint32_t protocol_version;
       cable->access(false, (unsigned int)(long)&this->debug_struct->protocol_version, 4, (char*)&protocol_version);
       
-      if (protocol_version != PROTOCOL_VERSION_4)
+      if (protocol_version != PROTOCOL_VERSION_4 && protocol_version != PROTOCOL_VERSION_5)
       {
-        this->log->error("Protocol version mismatch between bridge and runtime (bridge: %d, runtime: %d)\n", PROTOCOL_VERSION_4, protocol_version);
+        this->log->error("Protocol version mismatch between bridge and runtime (bridge: %d, runtime: %d)\n", PROTOCOL_VERSION_5, protocol_version);
         throw std::logic_error("Unable to connect to runtime");
       }
 
+      this->protocol_version = protocol_version;
+
       int32_t is_connected;
       this->cable->access(false, (unsigned int)(long)&this->debug_struct->target.connected, 4, (char*)&is_connected);
       this->connected = is_connected;
@@ -358,22 +424,48 @@ void Reqloop::activate()
 
 
 
-void Reqloop::notif_target(hal_debug_struct_t *debug_struct)
+void Reqloop::snapshot_prepare(std::vector<Cable_io_elem> &list)
 {
-  uint32_t notif_req_addr;
-  uint32_t notif_req_value;
-  cable->access(false, (unsigned int)(long)&debug_struct->notif_req_addr, 4, (char*)&notif_req_addr);
-  cable->access(false, (unsigned int)(long)&debug_struct->notif_req_value, 4, (char*)&notif_req_value);
+  int size = this->protocol_version >= PROTOCOL_VERSION_5 ? DEBUG_STRUCT_HOT_SIZE : DEBUG_STRUCT_HOT_SIZE_V4;
 
-  cable->access(true, (unsigned int)(long)notif_req_addr, 4, (char*)&notif_req_value);
+  list.push_back(Cable_io_elem(false, (unsigned int)(long)this->debug_struct + DEBUG_STRUCT_HOT_START,
+    size, (char *)&this->snapshot + DEBUG_STRUCT_HOT_START));
+}
+
+
+
+bool Reqloop::snapshot_update()
+{
+  std::vector<Cable_io_elem> list;
+  this->snapshot_prepare(list);
+  return this->cable->access_list(list);
+}
+
+
+
+void Reqloop::notif_target_prepare(std::vector<Cable_io_elem> &list)
+{
+  // The notification address and value are static, they are taken from the
+  // snapshot instead of being read again
+  list.push_back(Cable_io_elem(true, this->snapshot.notif_req_addr, 4, (char*)&this->snapshot.notif_req_value));
+}
+
+
+
+void Reqloop::notif_target(hal_debug_struct_t *debug_struct)
+{
+  std::vector<Cable_io_elem> list;
+  this->notif_target_prepare(list);
+  this->cable->access_list(list);
 }
 
 void Reqloop::reply_req(hal_debug_struct_t *debug_struct, hal_bridge_req_t *target_req, hal_bridge_req_t *req)
 {
   uint32_t value = 1;
-  this->cable->access(true, (unsigned int)(long)&target_req->done, sizeof(target_req->done), (char*)&value);
-
-  this->notif_target(debug_struct);
+  std::vector<Cable_io_elem> list;
+  list.push_back(Cable_io_elem(true, (unsigned int)(long)&target_req->done, sizeof(target_req->done), (char*)&value));
+  this->notif_target_prepare(list);
+  this->cable->access_list(list);
 }
 
 static int transpose_code(int code)
@@ -438,30 +530,102 @@ bool Reqloop::handle_req_open(hal_debug_struct_t *debug_struct, hal_bridge_req_t
   return false;
 }
 
+int Reqloop::read_mapped(int file, uint32_t ptr, int size)
+{
+  // Only regular files can be mapped, the others are read by chunks
+  struct stat file_stat;
+  if (fstat(file, &file_stat) != 0 || !S_ISREG(file_stat.st_mode))
+    return -1;
+
+  off_t offset = lseek(file, 0, SEEK_CUR);
+  if (offset == (off_t)-1)
+    return -1;
+
+  if (offset >= file_stat.st_size)
+    return 0;
+
+  if (size > file_stat.st_size - offset)
+    size = file_stat.st_size - offset;
+
+  off_t map_offset = offset & ~(sysconf(_SC_PAGESIZE) - 1);
+  size_t map_size = size + (offset - map_offset);
+  char *map = (char *)mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, file, map_offset);
+  if (map == MAP_FAILED)
+    return -1;
+
+  // The whole file content is already there, all the chunks can be queued
+  // to the cable at once
+  char *data = map + (offset - map_offset);
+  int chunk_size = this->cable->get_burst_size() * REQLOOP_IO_CHUNK_BURSTS;
+  std::vector<std::future<bool>> futures;
+  for (int done=0; done<size; done+=chunk_size)
+  {
+    int iter_size = size - done < chunk_size ? size - done : chunk_size;
+    futures.push_back(this->cable->access_async(true, ptr + done, iter_size, data + done));
+  }
+
+  bool result = true;
+  for (auto &future: futures)
+    result = future.get() && result;
+
+  munmap(map, map_size);
+
+  if (!result)
+  {
+    this->log->warning("Failed to write file content to target (addr: 0x%x, size: %d)\n", ptr, size);
+  }
+
+  lseek(file, offset + size, SEEK_SET);
+
+  return size;
+}
+
 bool Reqloop::handle_req_read(hal_debug_struct_t *debug_struct, hal_bridge_req_t *req, hal_bridge_req_t *target_req)
 {
-  char buffer[4096];
   int size = req->read.len;
-  char *ptr = (char *)(long)req->read.ptr;
-  int res = 0;
-  while (size)
+  uint32_t ptr = req->read.ptr;
+  int res = this->read_mapped(req->read.file, ptr, size);
+
+  if (res == -1)
   {
-    int iter_size = size;
-    if (iter_size > 4096)
-      iter_size = 4096;
+    // Double-buffering, the next chunk is read from the file while the
+    // previous one is being written to the target
+    int chunk_size = this->cable->get_burst_size() * REQLOOP_IO_CHUNK_BURSTS;
+    std::vector<char> buffers[2] = { std::vector<char>(chunk_size), std::vector<char>(chunk_size) };
+    std::future<bool> futures[2];
+    int index = 0;
+
+    res = 0;
+    while (size)
+    {
+      int iter_size = size;
+      if (iter_size > chunk_size)
+        iter_size = chunk_size;
 
-    iter_size = read(req->read.file, (void *)buffer, iter_size);
+      // Wait until the transfer using this buffer is over
+      if (futures[index].valid())
+        futures[index].get();
 
-    if (iter_size <= 0) {
-      if (iter_size == -1 && res == 0) res = -1;
-      break;
-    }
+      iter_size = read(req->read.file, (void *)&buffers[index][0], iter_size);
 
-    cable->access(true, (unsigned int)(long)ptr, iter_size, (char*)buffer);
+      if (iter_size <= 0) {
+        if (iter_size == -1 && res == 0) res = -1;
+        break;
+      }
 
-    res += iter_size;
-    ptr += iter_size;
-    size -= iter_size;
+      futures[index] = cable->access_async(true, ptr, iter_size, &buffers[index][0]);
+
+      res += iter_size;
+      ptr += iter_size;
+      size -= iter_size;
+      index ^= 1;
+    }
+
+    for (int i=0; i<2; i++)
+    {
+      if (futures[i].valid())
+        futures[i].get();
+    }
   }
 
   cable->access(true, (unsigned int)(long)&target_req->read.retval, 4, (char*)&res);
@@ -472,26 +636,55 @@ bool Reqloop::handle_req_read(hal_debug_struct_t *debug_struct, hal_bridge_req_t
 
 bool Reqloop::handle_req_write(hal_debug_struct_t *debug_struct, hal_bridge_req_t *req, hal_bridge_req_t *target_req)
 {
-  char buffer[4096];
+  // Double-buffering, the next chunk is read from the target while the
+  // previous one is being written to the file
+  int chunk_size = this->cable->get_burst_size() * REQLOOP_IO_CHUNK_BURSTS;
+  std::vector<char> buffers[2] = { std::vector<char>(chunk_size), std::vector<char>(chunk_size) };
+  std::future<bool> futures[2];
+  int sizes[2];
+  int index = 0;
   int size = req->write.len;
-  char *ptr = (char *)(long)req->write.ptr;
+  uint32_t ptr = req->write.ptr;
   int res = 0;
+
+  sizes[0] = size < chunk_size ? size : chunk_size;
+  if (sizes[0])
+    futures[0] = cable->access_async(false, ptr, sizes[0], &buffers[0][0]);
+
   while (size)
   {
-    int iter_size = size;
-    if (iter_size > 4096)
-      iter_size = 4096;
+    int iter_size = sizes[index];
+    int next_size = size - iter_size < chunk_size ? size - iter_size : chunk_size;
 
-    cable->access(false, (unsigned int)(long)ptr, iter_size, (char*)buffer);
+    if (next_size)
+    {
+      sizes[index ^ 1] = next_size;
+      futures[index ^ 1] = cable->access_async(false, ptr + iter_size, next_size, &buffers[index ^ 1][0]);
+    }
 
-    iter_size = write(req->write.file, (void *)buffer, iter_size);
+    futures[index].get();
 
-    if (iter_size <= 0)
+    int written = write(req->write.file, (void *)&buffers[index][0], iter_size);
+
+    if (written <= 0)
+      break;
+
+    res += written;
+
+    // The next chunk was prefetched assuming this one was fully written
+    if (written < iter_size)
       break;
 
-    res += iter_size;
     ptr += iter_size;
     size -= iter_size;
+    index ^= 1;
+  }
+
+  // The prefetched chunk may still be in flight if the file write failed
+  for (int i=0; i<2; i++)
+  {
+    if (futures[i].valid())
+      futures[i].get();
   }
 
   if (res == 0)
@@ -745,30 +938,32 @@ void Reqloop::handle_target_req(hal_debug_struct_t *debug_struct, Target_req *ta
 
   uint32_t next;
   this->cable->access(false, (unsigned int)(long)&req->next, 4, (char*)&next);
-  this->cable->access(true, (unsigned int)(long)&debug_struct->first_bridge_free_req, 4, (char*)&next);
-  this->cable->access(true, (unsigned int)(long)req, sizeof(hal_bridge_req_t), (char*)&target_req->target_req);
-  this->cable->access(true, (unsigned int)(long)&req->bridge_data, sizeof(target_req), (char*)&target_req);
-
 
-  // Store it to the debug structure
-  this->cable->access(true, (unsigned int)(long)&debug_struct->target_req, 4, (char*)&req);
-
-  // And notify the target so that it is processed
-  this->notif_target(debug_struct);
+  // Pop the request, fill it, store it to the debug structure and notify the
+  // target so that it is processed, all in one burst
+  std::vector<Cable_io_elem> list;
+  list.push_back(Cable_io_elem(true, (unsigned int)(long)&debug_struct->first_bridge_free_req, 4, (char*)&next));
+  list.push_back(Cable_io_elem(true, (unsigned int)(long)req, sizeof(hal_bridge_req_t), (char*)&target_req->target_req));
+  list.push_back(Cable_io_elem(true, (unsigned int)(long)&req->bridge_data, sizeof(target_req), (char*)&target_req));
+  list.push_back(Cable_io_elem(true, (unsigned int)(long)&debug_struct->target_req, 4, (char*)&req));
+  this->notif_target_prepare(list);
+  this->cable->access_list(list);
+
+  this->snapshot.target_req = (uint32_t)(long)req;
 }
 
-void Reqloop::handle_bridge_to_target_reqs(hal_debug_struct_t *debug_struct)
+bool Reqloop::handle_bridge_to_target_reqs(hal_debug_struct_t *debug_struct)
 {
+  bool handled = false;
+
   if (!this->connected)
-    return;
+    return false;
 
   while(this->target_reqs.size())
   {
     // Runtime can only handle one request, first check if no request is already
     // pushed.
-    uint32_t target_req;
-    this->cable->access(false, (unsigned int)(long)&debug_struct->target_req, 4, (char*)&target_req);
-    if (target_req)
+    if (this->snapshot.target_req)
       break;
 
     this->mutex.lock();
@@ -776,9 +971,204 @@ void Reqloop::handle_bridge_to_target_reqs(hal_debug_struct_t *debug_struct)
     this->target_reqs.pop();
     this->handle_target_req(debug_struct, bridge_target_req);
     this->mutex.unlock();
+    handled = true;
+  }
+
+  return handled;
+}
+
+Reqloop_channel *Reqloop::get_channel(Reqloop_channel *channel, hal_debug_ring_t *ring, bool up)
+{
+  if (ring->name == 0 || ring->size == 0 || ring->head >= ring->size || ring->tail >= ring->size)
+    return NULL;
+
+  if (channel->name_addr != ring->name)
+  {
+    char name[DEBUG_RING_NAME_SIZE + 1] = {0};
+    if (!this->cable->access(false, ring->name, DEBUG_RING_NAME_SIZE, name))
+      return NULL;
+
+    if (channel->file && channel->file != stdout && channel->file != stderr)
+      fclose(channel->file);
+
+    channel->name_addr = ring->name;
+    channel->name = name;
+    channel->file = NULL;
+    channel->fd = -1;
+
+    if (up)
+    {
+      if (channel->name == "stdout")
+        channel->file = stdout;
+      else if (channel->name == "stderr")
+        channel->file = stderr;
+      else if (channel->name.find('/') != std::string::npos || channel->name.find("..") != std::string::npos)
+      {
+        // The name comes from the target, it must not be able to choose
+        // where the file is created
+        this->log->warning("Invalid channel name (name: %s)\n", channel->name.c_str());
+      }
+      else
+      {
+        std::string path = "channel_" + channel->name + ".bin";
+        channel->file = fopen(path.c_str(), "wb");
+        if (channel->file == NULL)
+          this->log->warning("Failed to open channel output (path: %s)\n", path.c_str());
+      }
+    }
+    else
+    {
+      if (channel->name == "stdin")
+        channel->fd = 0;
+      else
+        this->log->warning("Unsupported down channel (name: %s)\n", channel->name.c_str());
+    }
+
+    this->log->debug("Opened ring channel (name: %s, size: %d, up: %d)\n", channel->name.c_str(), ring->size, up);
+  }
+
+  return channel;
+}
+
+
+
+bool Reqloop::handle_rings(hal_debug_struct_t *debug_struct)
+{
+  if (this->protocol_version < PROTOCOL_VERSION_5)
+    return false;
+
+  // All the data moves of all rings are done in one burst. The data is
+  // always accessed before the index is moved, as the accesses of the list
+  // are done in order.
+  std::vector<Cable_io_elem> list;
+  std::vector<char> up_data[HAL_DEBUG_NB_RINGS];
+  std::vector<char> down_data[HAL_DEBUG_NB_RINGS];
+
+  for (int i=0; i<HAL_DEBUG_NB_RINGS; i++)
+  {
+    hal_debug_ring_t *ring = &this->snapshot.up_rings[i];
+    Reqloop_channel *channel = this->get_channel(&this->up_channels[i], ring, true);
+    if (channel == NULL || ring->head == ring->tail)
+      continue;
+
+    uint32_t head = ring->head;
+    uint32_t tail = ring->tail;
+    int first = head > tail ? head - tail : ring->size - tail;
+    int second = head > tail ? 0 : head;
+
+    up_data[i].resize(first + second);
+    list.push_back(Cable_io_elem(false, ring->buffer + tail, first, &up_data[i][0]));
+    if (second)
+      list.push_back(Cable_io_elem(false, ring->buffer, second, &up_data[i][first]));
+
+    ring->tail = head;
+    list.push_back(Cable_io_elem(true, (unsigned int)(long)&debug_struct->up_rings[i].tail, 4, (char *)&ring->tail));
+  }
+
+  for (int i=0; i<HAL_DEBUG_NB_RINGS; i++)
+  {
+    hal_debug_ring_t *ring = &this->snapshot.down_rings[i];
+    Reqloop_channel *channel = this->get_channel(&this->down_channels[i], ring, false);
+    if (channel == NULL || channel->fd == -1)
+      continue;
+
+    uint32_t head = ring->head;
+    uint32_t tail = ring->tail;
+    int free_size = (tail + ring->size - head - 1) % ring->size;
+    if (free_size == 0)
+      continue;
+
+    // Only take what is already there to never block the loop
+    struct pollfd fds = { channel->fd, POLLIN, 0 };
+    if (::poll(&fds, 1, 0) <= 0)
+      continue;
+
+    down_data[i].resize(free_size);
+    int size = ::read(channel->fd, &down_data[i][0], free_size);
+    if (size <= 0)
+    {
+      // End of file, stop polling it
+      channel->fd = -1;
+      continue;
+    }
+
+    int first = ring->size - head;
+    if (first > size)
+      first = size;
+
+    list.push_back(Cable_io_elem(true, ring->buffer + head, first, &down_data[i][0]));
+    if (size > first)
+      list.push_back(Cable_io_elem(true, ring->buffer, size - first, &down_data[i][first]));
+
+    ring->head = (head + size) % ring->size;
+    list.push_back(Cable_io_elem(true, (unsigned int)(long)&debug_struct->down_rings[i].head, 4, (char *)&ring->head));
+  }
+
+  if (list.size() == 0)
+    return false;
+
+  if (!this->cable->access_list(list))
+  {
+    this->log->warning("Failed to access ring buffers\n");
+    return false;
+  }
+
+  for (int i=0; i<HAL_DEBUG_NB_RINGS; i++)
+  {
+    if (up_data[i].size() && this->up_channels[i].file)
+    {
+      fwrite(&up_data[i][0], 1, up_data[i].size(), this->up_channels[i].file);
+      fflush(this->up_channels[i].file);
+    }
+  }
+
+  return true;
+}
+
+
+
+void Reqloop::close_channels()
+{
+  for (int i=0; i<HAL_DEBUG_NB_RINGS; i++)
+  {
+    FILE *file = this->up_channels[i].file;
+    if (file && file != stdout && file != stderr)
+      fclose(file);
+    this->up_channels[i].file = NULL;
+  }
+}
+
+
+
+void Reqloop::poll_activity()
+{
+  this->poll_burst_count = this->poll_burst;
+  this->poll_backoff.reset();
+}
+
+
+
+void Reqloop::poll_wait()
+{
+  if (this->poll_burst_count > 0)
+  {
+    this->poll_burst_count--;
+    return;
   }
+
+  std::unique_lock<std::mutex> lock(this->mutex);
+
+  // Requests from the host are only pushed once the target is connected
+  if (this->connected && this->target_reqs.size())
+    return;
+
+  int period = this->poll_backoff.next_period();
+  if (period)
+    this->cond.wait_for(lock, std::chrono::microseconds(period));
 }
 
+
+
 void Reqloop::reqloop_routine()
 {
   // In case the birdge is not yet connected, do extra init steps to
@@ -787,6 +1177,8 @@ void Reqloop::reqloop_routine()
 
   this->jtag_val = 0;
 
+  this->poll_activity();
+
   if (debug_struct_addr) {
 
     // In case the debug struct pointer is found, iterate to receive IO requests
@@ -800,12 +1192,17 @@ void Reqloop::reqloop_routine()
       if (!this->wait_target_request())
       {
         // If not, just wait a bit and retry
-        usleep(100);
+        this->poll_wait();
         continue;
       }
 
+      bool active = false;
+
+      // Get the exit status, printf buffer and request lists in one burst
+      if (!this->snapshot_update()) goto end;
+
       // First check if the application has exited
-      cable->access(false, (unsigned int)(long)&debug_struct->exit_status, 4, (char*)&value);
+      value = this->snapshot.exit_status;
       if (value >> 31) {
         status = ((int)value << 1) >> 1;
         printf("Detected end of application, exiting with status: %d\n", status);
@@ -816,21 +1213,28 @@ void Reqloop::reqloop_routine()
       // The target application should quickly dumps the characters, so we can loop on printf
       // until we don't find anything
       while(1) {
-        cable->access(false, (unsigned int)(long)&debug_struct->pending_putchar, 4, (char*)&value);
+        value = this->snapshot.pending_putchar;
         if (value == 0) break;
-        char buff[value+1];
-        cable->access(false, (unsigned int)(long)&debug_struct->putc_buffer, value, (char*)buff);
-        unsigned int zero = 0;
-        cable->access(true, (unsigned int)(long)&debug_struct->pending_putchar, 4, (char*)&zero);
-        for (int i=0; i<value; i++) putchar(buff[i]);
+        if (value > HAL_PRINTF_BUF_SIZE) value = HAL_PRINTF_BUF_SIZE;
+        for (int i=0; i<value; i++) putchar(this->snapshot.putc_buffer[i]);
         fflush(NULL);
+        active = true;
+
+        // Release the buffer and get the next characters in the same burst
+        unsigned int zero = 0;
+        std::vector<Cable_io_elem> list;
+        list.push_back(Cable_io_elem(true, (unsigned int)(long)&debug_struct->pending_putchar, 4, (char*)&zero));
+        this->snapshot_prepare(list);
+        if (!this->cable->access_list(list)) goto end;
       }
 
+      // Drain and fill the ring buffers
+      if (this->handle_rings(debug_struct))
+        active = true;
+
       // Handle target to bridge requests
       while(1) {
-        hal_bridge_req_t *first_bridge_req=NULL, *last_req=NULL, *next=NULL, *next_next=NULL;
-
-        if (!cable->access(false, (unsigned int)(long)&debug_struct->first_bridge_req, 4, (char*)&first_bridge_req)) goto end;
+        hal_bridge_req_t *first_bridge_req = (hal_bridge_req_t *)(long)this->snapshot.first_bridge_req;
 
         if (first_bridge_req == NULL)
           break;
@@ -839,21 +1243,30 @@ void Reqloop::reqloop_routine()
         if (!this->cable->access(false, (unsigned int)(long)first_bridge_req, sizeof(hal_bridge_req_t), (char*)&req)) goto end;
 
         value = 1;
-        if (!cable->access(true, (unsigned int)(long)&first_bridge_req->popped, sizeof(first_bridge_req->popped), (char*)&value)) goto end;
-        if (!cable->access(true, (unsigned int)(long)&debug_struct->first_bridge_req, 4, (char*)&req.next)) goto end;
+        std::vector<Cable_io_elem> list;
+        list.push_back(Cable_io_elem(true, (unsigned int)(long)&first_bridge_req->popped, sizeof(first_bridge_req->popped), (char*)&value));
+        list.push_back(Cable_io_elem(true, (unsigned int)(long)&debug_struct->first_bridge_req, 4, (char*)&req.next));
+        if (!this->cable->access_list(list)) goto end;
 
         if (this->handle_req(debug_struct, &req, first_bridge_req))
           return;
-      }
 
-      // Handle bridge to target requests
-      this->handle_bridge_to_target_reqs(debug_struct);
+        active = true;
 
-      if (!this->target_jtag_sync)
-      {
-        // Small sleep to not poll too often
-        usleep(500);
+        // The handler may have changed the debug struct
+        if (!this->snapshot_update()) goto end;
       }
+
+      // Handle bridge to target requests
+      if (this->handle_bridge_to_target_reqs(debug_struct))
+        active = true;
+
+      // Poll again quickly if something happened as the application is
+      // likely to do more requests, otherwise wait a bit longer each time
+      if (active)
+        this->poll_activity();
+      else
+        this->poll_wait();
     }
   }
   else
@@ -881,6 +1294,7 @@ void Reqloop::efuse_access(bool write, int id, uint32_t value, uint32_t mask)
   std::unique_lock<std::mutex> lock(this->mutex);
 
   this->target_reqs.push(req);
+  this->cond.notify_all();
 
   while(!req->done)
   {
@@ -905,6 +1319,7 @@ int Reqloop::eeprom_access(uint32_t itf, uint32_t cs, bool write, uint32_t addr,
 
   std::unique_lock<std::mutex> lock(this->mutex);
   this->target_reqs.push(req);
+  this->cond.notify_all();
 
   while(!req->done)
   {
@@ -936,6 +1351,7 @@ int Reqloop::flash_access(int type, uint32_t itf, uint32_t cs, bool write, uint3
 
   std::unique_lock<std::mutex> lock(this->mutex);
   this->target_reqs.push(req);
+  this->cond.notify_all();
 
   while(!req->done)
   {
@@ -965,6 +1381,7 @@ int Reqloop::flash_erase(int type, uint32_t itf, uint32_t cs, uint32_t addr, int
 
   std::unique_lock<std::mutex> lock(this->mutex);
   this->target_reqs.push(req);
+  this->cond.notify_all();
 
   while(!req->done)
   {
@@ -993,6 +1410,7 @@ int Reqloop::flash_erase_sector(int type, uint32_t itf, uint32_t cs, uint32_t ad
 
   std::unique_lock<std::mutex> lock(this->mutex);
   this->target_reqs.push(req);
+  this->cond.notify_all();
 
   while(!req->done)
   {
@@ -1020,6 +1438,7 @@ int Reqloop::flash_erase_chip(int type, uint32_t itf, uint32_t cs)
 
   std::unique_lock<std::mutex> lock(this->mutex);
   this->target_reqs.push(req);
+  this->cond.notify_all();
 
   while(!req->done)
   {
@@ -1046,6 +1465,7 @@ void Reqloop::buffer_free(uint32_t addr, uint32_t size)
 
   std::unique_lock<std::mutex> lock(this->mutex);
   this->target_reqs.push(req);
+  this->cond.notify_all();
 
   while(!req->done)
   {
@@ -1067,6 +1487,7 @@ uint32_t Reqloop::buffer_alloc(uint32_t size)
 
   std::unique_lock<std::mutex> lock(this->mutex);
   this->target_reqs.push(req);
+  this->cond.notify_all();
 
   while(!req->done)
   {
@@ -1101,6 +1522,17 @@ Reqloop::Reqloop(Cable *cable, unsigned int debug_struct_addr) : cable(cable), d
 
   std::string chip = config->get("**/chip/name")->get_str();
 
+  int poll_min_us = REQLOOP_POLL_MIN_US;
+  int poll_max_us = REQLOOP_POLL_MAX_US;
+  this->poll_burst = REQLOOP_POLL_BURST;
+  if (config->get("**/debug_bridge/poll_min_us") != NULL)
+    poll_min_us = config->get_int("**/debug_bridge/poll_min_us");
+  if (config->get("**/debug_bridge/poll_max_us") != NULL)
+    poll_max_us = config->get_int("**/debug_bridge/poll_max_us");
+  if (config->get("**/debug_bridge/poll_burst") != NULL)
+    this->poll_burst = config->get_int("**/debug_bridge/poll_burst");
+  this->poll_backoff = Poll_backoff(0, poll_min_us, poll_max_us);
+
   // Try to connect the bridge now before the execution is started so
   // that the target sees the bridge as soon as it starts.
   // Otherwise, the bridge will get connected later on when the target